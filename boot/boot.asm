@@ -3,6 +3,8 @@
 
 KERNEL_OFFSET equ 0x1000
 KERNEL_SECTORS equ 170  ; Changed from 64 to 170 (85KB worth of sectors which is the kernel size at this moment)
+E820_MAP equ 0x0500     ; dword entry count followed by 24-byte entries
+E820_MAX equ 32
 
 start:
     ; Setup segments
@@ -19,6 +21,32 @@ start:
     mov si, boot_msg
     call print_string
 
+    ; Collect the BIOS E820 memory map while we still can
+    mov di, E820_MAP + 4
+    xor ebx, ebx
+    xor ebp, ebp
+e820_loop:
+    mov eax, 0xE820
+    mov edx, 0x534D4150       ; 'SMAP'
+    mov ecx, 24
+    mov dword [di + 20], 1    ; Valid unless an ACPI 3.0 BIOS says otherwise
+    int 0x15
+    jc e820_done              ; Carry on the first call means unsupported
+    cmp eax, 0x534D4150
+    jne e820_done
+    mov ecx, [di + 8]         ; Skip zero-length entries
+    or ecx, [di + 12]
+    jz e820_next
+    inc bp
+    add di, 24
+e820_next:
+    test ebx, ebx             ; EBX = 0 marks the last entry
+    jz e820_done
+    cmp bp, E820_MAX
+    jb e820_loop
+e820_done:
+    mov [E820_MAP], ebp
+
     ; Reset disk
     xor ah, ah
     xor dl, dl          ; Floppy drive
@@ -140,7 +168,8 @@ pm_start:
     ; Setup stack
     mov esp, 0x90000
     
-    ; Jump to kernel
+    ; Jump to kernel, EBX points at the memory map
+    mov ebx, E820_MAP
     call KERNEL_OFFSET
     
     ; Should never reach here
@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+// In-kernel microbenchmarks, run from the shell with `bench <name>`
+void bench_run(const char *name);
+void bench_list(void);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_USEC 1000u
+#define NSEC_PER_MSEC 1000000u
+#define NSEC_PER_SEC  1000000000u
+
+// Length and number of the PIT channel 2 gates the TSC is timed against;
+// the shortest measurement wins, as anything that stole time only adds
+#define CLOCK_CALIBRATE_MS   10
+#define CLOCK_CALIBRATE_RUNS 5
+
+// Monotonic time since boot, read from the TSC once clock_init has
+// calibrated it and from the timer tick until then or without a TSC
+void clock_init(void);
+bool clock_has_tsc(void);
+uint32_t clock_tsc_khz(void);
+uint64_t clock_ns(void);
+uint64_t cycles_to_ns(uint64_t cycles);
+
+// Busy-wait for at least the given time
+void ndelay(uint32_t nanoseconds);
+void udelay(uint32_t microseconds);
+
+// 64-by-32 division, for the libgcc helper this kernel doesn't link
+uint64_t div_u64(uint64_t dividend, uint32_t divisor, uint32_t *remainder);
+
+void clock_report(void);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_EDX_PSE   (1 << 3)
+#define CPUID_EDX_MSR   (1 << 5)
+#define CPUID_EDX_APIC  (1 << 9)
+#define CPUID_EDX_PGE   (1 << 13)
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+#define CPUID_EDX_SSE2  (1 << 26)
+
+#define EFLAGS_IF       (1 << 9)
+
+// Control register bits
+#define CR0_MP          (1 << 1)
+#define CR0_EM          (1 << 2)
+#define CR0_TS          (1 << 3)
+#define CR0_NE          (1 << 5)
+#define CR4_PSE         (1 << 4)
+#define CR4_PGE         (1 << 7)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+
+// Model-specific registers
+#define MSR_APIC_BASE   0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline bool cpu_has_edx_feature(uint32_t bit) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & bit) != 0;
+}
+
+// Disable interrupts, returning the previous EFLAGS for irq_restore
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & EFLAGS_IF) {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+static inline bool irqs_enabled(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r"(flags));
+    return (flags & EFLAGS_IF) != 0;
+}
+
+// Spin-wait hint: saves power and lets the sibling hyperthread run
+static inline void cpu_relax(void) {
+    asm volatile("pause" : : : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+#endif
@@ -98,13 +98,14 @@ typedef struct {
 
 // Function prototypes
 void keyboard_init(void);
-void keyboard_handler(void);
+void keyboard_handler(void); // Bottom half, run as SOFTIRQ_KEYBOARD
 uint8_t keyboard_read_data(void);
 void keyboard_write_data(uint8_t data);
 uint8_t keyboard_read_status(void);
 void keyboard_write_command(uint8_t command);
 bool keyboard_data_available(void);
 char keyboard_get_char(void);
+char keyboard_read_char(void);
 void keyboard_wait_input(void);
 void keyboard_wait_output(void);
 void keyboard_set_leds(uint8_t leds);
@@ -0,0 +1,35 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "process.h"
+
+// FXSAVE image; FNSAVE's smaller one fits too on CPUs without FXSR
+typedef struct fpu_state {
+    uint8_t data[512];
+} __attribute__((aligned(16))) fpu_state_t;
+
+// Lazy FPU switching: CR0.TS is set whenever the registers belong to a task
+// other than the one running, so the first FPU instruction traps (#NM) and
+// the state is swapped then rather than on every task switch. Ownership is
+// per CPU.
+void fpu_init(void);
+bool fpu_handle_trap(void);
+void fpu_switch(process_t *prev, process_t *next);
+bool fpu_fork(process_t *parent, process_t *child);
+void fpu_release(process_t *proc);
+
+// Kernel code may only touch FPU/SSE registers between these calls. The
+// section runs with interrupts off and must not nest.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+// SSE2 bulk kernels; call them only inside a kernel FPU section
+bool sse2_available(void);
+void sse_memcpy(void *dest, const void *src, size_t n);
+void sse_memset(void *dest, int c, size_t n);
+void sse_zero_page(void *page);
+
+#endif
@@ -30,6 +30,15 @@ typedef struct {
     uint32_t base;
 } __attribute__((packed)) idt_ptr_t;
 
+// Stack layout built by isr_common_stub and irq_common_stub, passed to
+// handlers that need it
+typedef struct {
+    uint32_t ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax; // pusha
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags;                        // Pushed by the CPU
+} interrupt_frame_t;
+
 extern idt_entry_t idt[IDT_ENTRIES];
 extern idt_ptr_t idt_ptr;
 
@@ -42,8 +51,9 @@ void divide_error_handler(void);
 void debug_handler(void);
 void nmi_handler(void);
 void breakpoint_handler(void);
+void device_not_available_handler(void);
 void general_protection_fault_handler(void);
-void page_fault_handler(void);
+void page_fault_handler(interrupt_frame_t *frame);
 void fault_handler(void);
 
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@ typedef uint32_t size_t;
 // Forward declarations to avoid circular dependencies
 struct process;
 typedef struct process process_t;
+struct e820_map;
 
 // Memory management functions
 uint32_t kmalloc(uint32_t size);
@@ -18,6 +19,9 @@ uint32_t kmalloc_a(uint32_t size);
 uint32_t kmalloc_p(uint32_t size, uint32_t *phys_addr);
 uint32_t kmalloc_ap(uint32_t size, uint32_t *phys_addr);
 void kfree(void *ptr);
+void *krealloc(void *ptr, uint32_t size);
+void heap_report(void);
+void heap_leak_report(uint32_t limit);
 void *malloc(size_t size);
 void free(void *ptr);
 void *memset(void *dest, int c, size_t n);
@@ -55,8 +59,9 @@ void package_manager_init(void);
 void scripting_init(void);
 
 // Core kernel functions
-void kernel_init(void);
-void kernel_main(void);
+void kernel_init(const struct e820_map *memory_map);
+void kernel_main(const struct e820_map *memory_map);
+void kernel_idle(void);
 
 // Process management (forward declarations)
 void schedule(void);
@@ -64,6 +69,6 @@ process_t *create_process(const char *name, void (*entry_point)(void), bool kern
 void alloc_frame(uint32_t addr, bool is_kernel, bool is_writable);
 
 // Context switching
-void context_switch(void *prev_state, void *next_state);
+void context_switch(uint32_t *prev_sp, uint32_t next_sp);
 
 #endif
\ No newline at end of file
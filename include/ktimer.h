@@ -0,0 +1,64 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kernel timers on a hierarchical wheel: 256 one-tick slots for the next
+// 2.56 seconds, then four levels of 64 slots, each slot covering a whole
+// turn of the level below. Adding and cancelling are O(1); a timer is
+// moved down a level each time the wheel below it wraps, so it is only
+// touched a few times before it fires.
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+typedef struct ktimer {
+    struct ktimer *next;   // Slot neighbours while pending
+    struct ktimer **pprev; // The pointer to this timer, NULL if not pending
+    uint32_t expires;      // Tick it fires at
+    void (*callback)(struct ktimer *timer);
+    void *data;
+} ktimer_t;
+
+typedef struct {
+    uint32_t pending;  // Timers on the wheel
+    uint32_t fired;
+    uint32_t cascaded; // Moves down a level
+} ktimer_stats_t;
+
+extern ktimer_stats_t ktimer_stats;
+
+void ktimer_init(ktimer_t *timer, void (*callback)(ktimer_t *timer), void *data);
+
+// Arm for the given tick, first cancelling if already pending. A tick that
+// has already gone by fires on the next one. Callbacks run from the boot
+// CPU's timer softirq, with interrupts on, after the timer has been taken
+// off; they must not sleep.
+void ktimer_add(ktimer_t *timer, uint32_t expires);
+
+// Returns whether it was still pending. A callback already running on
+// another CPU is waited out, so the timer can be freed afterwards; a
+// callback must not cancel its own timer.
+bool ktimer_cancel(ktimer_t *timer);
+
+static inline bool ktimer_pending(const ktimer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+// Timer softirq: fire everything due up to and including `now`
+void ktimer_run(uint32_t now);
+
+// Ticks after `now` until the wheel next has work, up to `limit`, for
+// halting without the periodic tick. Until ktimer_idle_exit, a timer
+// added on another CPU that is due sooner sends the boot CPU a reschedule
+// IPI, whose interrupt puts the tick back.
+uint32_t ktimer_idle_ticks(uint32_t now, uint32_t limit);
+void ktimer_idle_exit(void);
+
+#endif
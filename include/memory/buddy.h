@@ -0,0 +1,40 @@
+#ifndef MEMORY_BUDDY_H
+#define MEMORY_BUDDY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BUDDY_MAX_ORDER 10 // Largest block is 2^10 frames (4MB)
+#define BUDDY_NONE      0xFFFFFFFF
+
+// Frame flags
+#define FRAME_FREE      0x01 // Head of a block on a free list
+
+// Per-frame bookkeeping. Only the first frame of a block carries its order
+// and flags; free-list links are frame numbers.
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t refcount;
+} frame_info_t;
+
+void buddy_init(uint32_t total_frames, frame_info_t *storage);
+void buddy_free_range(uint32_t start_addr, uint32_t end_addr);
+
+// Physically contiguous runs of 2^order frames. Frame 0 is never handed out,
+// so 0 doubles as the failure value.
+uint32_t alloc_pages(uint32_t order);
+void free_pages(uint32_t addr, uint32_t order);
+
+// Single-frame views used by the paging layer
+bool buddy_frame_free(uint32_t frame);
+bool buddy_claim_frame(uint32_t frame);
+uint32_t buddy_any_free_frame(void);
+
+uint32_t buddy_total_frames(void);
+uint32_t buddy_free_frames(void);
+frame_info_t *buddy_frame_info(uint32_t frame);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef MEMORY_E820_H
+#define MEMORY_E820_H
+
+#include <stdint.h>
+
+// Memory map collected by boot/boot.asm with INT 15h, AX=E820h
+#define E820_MAP_ADDR     0x0500
+#define E820_MAX_ENTRIES  32
+
+// Region types
+#define E820_USABLE       1
+#define E820_RESERVED     2
+#define E820_ACPI_RECLAIM 3
+#define E820_ACPI_NVS     4
+#define E820_BAD          5
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi; // ACPI 3.0 extended attributes
+} __attribute__((packed)) e820_entry_t;
+
+typedef struct e820_map {
+    uint32_t count;
+    e820_entry_t entries[E820_MAX_ENTRIES];
+} __attribute__((packed)) e820_map_t;
+
+#endif
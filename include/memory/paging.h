@@ -3,37 +3,115 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "memory/e820.h"
+#include "cpu.h"
 
 #define PAGE_SIZE 4096
 #define PAGE_ENTRIES 1024
+#define LARGE_PAGE_SIZE 0x400000
+
+// Kernel memory layout. All RAM below DIRECT_MAP_LIMIT is identity mapped
+// into every address space; anything above it is ignored.
+#define DIRECT_MAP_LIMIT    0x40000000
+
+// Above user space, the heap and vmalloc regions are backed with frames page
+// by page as they are used. Installed RAM caps how much of each is usable.
+#define KERNEL_HEAP_START   0xC0000000
+#define KERNEL_HEAP_END     0xD0000000
+#define VMALLOC_START       0xD0000000
+#define VMALLOC_END         0xE0000000
+
+// User address space
+#define USER_SPACE_START    0x40000000
+#define USER_SPACE_END      0xC0000000
+
+// The last directory entry points back at the directory itself, exposing the
+// current address space's page tables and directory at fixed addresses
+#define RECURSIVE_PDE       1023
+#define PAGE_TABLES_VADDR   0xFFC00000
+#define PAGE_DIR_VADDR      0xFFFFF000
 
 // Page directory/table entry flags
 #define PAGE_PRESENT    0x01
 #define PAGE_WRITABLE   0x02
 #define PAGE_USER       0x04
+#define PAGE_WRITETHROUGH 0x08
+#define PAGE_NOCACHE    0x10  // Device memory such as the local APIC
 #define PAGE_ACCESSED   0x20
 #define PAGE_DIRTY      0x40
+#define PAGE_LARGE      0x80  // Directory entry maps a 4MB page (needs CR4.PSE)
+#define PAGE_GLOBAL     0x100 // Survives CR3 reloads (needs CR4.PGE)
+#define PAGE_COW        0x200 // Available bit: shared until the first write
+
+// Page fault error code bits
+#define PF_PRESENT      0x01 // Protection violation rather than missing page
+#define PF_WRITE        0x02
+#define PF_USER         0x04
 
 typedef struct {
     uint32_t pages[PAGE_ENTRIES];
 } page_table_t;
 
+// A directory is exactly the page-aligned hardware structure loaded into CR3
 typedef struct {
-    page_table_t *tables[PAGE_ENTRIES];
-    uint32_t tables_physical[PAGE_ENTRIES];
-    uint32_t physical_addr;
+    uint32_t entries[PAGE_ENTRIES];
 } page_directory_t;
 
+// Directories are allocated from the direct map, where virtual = physical
+static inline uint32_t page_directory_phys(const page_directory_t *dir) {
+    return (uint32_t)dir;
+}
+
+typedef struct {
+    uint32_t page_flushes; // Single invlpg invalidations
+    uint32_t full_flushes; // Whole-TLB flushes
+    uint32_t cr3_loads;    // Address space switches
+    uint32_t cr3_skipped;  // Task switches that kept the same directory
+} tlb_stats_t;
+
+typedef struct {
+    uint32_t copied; // Write faults that needed a private copy
+    uint32_t reused; // Write faults where the last sharer kept the frame
+} cow_stats_t;
+
 extern page_directory_t *kernel_directory;
-extern page_directory_t *current_directory;
+
+// Whatever this CPU has loaded; directories sit in the direct map, so the
+// physical address in CR3 is also a pointer to it
+#define current_directory ((page_directory_t*)read_cr3())
+extern cow_stats_t cow_stats;
+extern tlb_stats_t tlb_stats;
+
+// Usable ends of the heap and vmalloc regions, set by paging_init
+extern uint32_t kernel_heap_end;
+extern uint32_t vmalloc_end;
 
 // Function prototypes
-void paging_init(void);
+void paging_init(const e820_map_t *memory_map);
 void switch_page_directory(page_directory_t *dir);
 page_directory_t *create_page_directory(void);
+void destroy_page_directory(page_directory_t *dir);
+page_directory_t *clone_directory(page_directory_t *src);
+uint32_t *get_page(uint32_t virtual_addr, bool make, page_directory_t *dir);
 void map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+void map_large_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+bool split_large_page(page_directory_t *dir, uint32_t virtual_addr);
 void unmap_page(uint32_t virtual_addr);
 uint32_t get_physical_address(uint32_t virtual_addr);
+bool paging_handle_fault(uint32_t virtual_addr, uint32_t error_code);
+
+// Back or release [start, end) of the heap or vmalloc region. Their page
+// tables are shared by every directory, so changes are seen everywhere.
+// Mapping fails, leaving nothing mapped, if frames run out; unmapping skips
+// holes and returns how many frames it freed.
+bool map_kernel_range(uint32_t start, uint32_t end);
+uint32_t unmap_kernel_range(uint32_t start, uint32_t end);
+
+// TLB maintenance for the current address space
+void tlb_flush_page(uint32_t virtual_addr);
+void tlb_flush_range(uint32_t start, uint32_t end);
+void tlb_flush_all(void);
+void tlb_report(void);
 
 // Frame management functions
 void set_frame(uint32_t frame_addr);
@@ -41,5 +119,12 @@ void clear_frame(uint32_t frame_addr);
 uint32_t test_frame(uint32_t frame_addr);
 uint32_t first_free_frame(void);
 void alloc_frame(uint32_t virtual_addr, bool is_kernel, bool is_writable);
+void alloc_frame_dir(page_directory_t *dir, uint32_t virtual_addr, bool is_kernel, bool is_writable);
+bool map_zero_page(page_directory_t *dir, uint32_t virtual_addr, bool is_writable);
+void unmap_user_page(page_directory_t *dir, uint32_t virtual_addr);
+void frame_get(uint32_t frame_addr);
+void frame_put(uint32_t frame_addr);
+uint32_t frame_refcount(uint32_t frame_addr);
+void frame_report(void);
 
 #endif
\ No newline at end of file
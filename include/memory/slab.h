@@ -0,0 +1,52 @@
+#ifndef MEMORY_SLAB_H
+#define MEMORY_SLAB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+#define SLAB_NAME_MAX    24
+#define SLAB_MIN_OBJECTS 8 // Grow slabs until they hold at least this many objects
+
+// Cache flags
+#define SLAB_ZERO        0x01 // Objects are handed out zero-filled
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+// A slab is one contiguous, page-aligned run carved from the kernel heap and
+// cut into equally sized objects
+typedef struct slab {
+    struct slab *next;
+    uint32_t base;
+} slab_t;
+
+// Objects are constructed once when their slab is carved and must be freed
+// back in their constructed state. SLAB_ZERO caches expect zeroed objects back.
+typedef struct kmem_cache {
+    char name[SLAB_NAME_MAX];
+    uint32_t object_size;
+    uint32_t stride;        // Object plus free-list link, rounded to the alignment
+    uint32_t link_offset;   // Where a free object keeps its free-list link
+    uint32_t align;
+    uint32_t flags;
+    uint32_t slab_size;     // Bytes per slab
+    uint32_t objs_per_slab;
+    kmem_ctor_t ctor;
+
+    slab_t *slabs;
+    void *free_list;
+    uint32_t slab_count;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    spinlock_t lock;        // Guards the free list, slabs and counts
+
+    struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                uint32_t flags, kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_report(void);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef MEMORY_VMALLOC_H
+#define MEMORY_VMALLOC_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t areas;    // Allocations outstanding
+    uint32_t pages;    // Frames mapped for them
+    uint32_t failures; // Requests that found no space or no frames
+} vmalloc_stats_t;
+
+// Virtually contiguous, page-granular kernel memory for buffers too large to
+// want physically contiguous frames. Each area is followed by an unmapped
+// guard page. Contents start out undefined; returns NULL on failure.
+void *vmalloc(uint32_t size);
+void vfree(void *addr);
+void vmalloc_report(void);
+
+extern vmalloc_stats_t vmalloc_stats;
+
+#endif
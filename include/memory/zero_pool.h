@@ -0,0 +1,34 @@
+#ifndef MEMORY_ZERO_POOL_H
+#define MEMORY_ZERO_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Allocation flags for alloc_page
+#define ALLOC_ZEROED        0x01 // Frame must read as zeros
+
+#define ZERO_POOL_DEFAULT   256  // Frames kept pre-zeroed (1MB)
+#define ZERO_POOL_MAX       4096
+#define ZERO_POOL_BATCH     8    // Frames scrubbed per idle pass
+
+typedef struct {
+    uint32_t depth;    // Frames currently in the pool
+    uint32_t high;     // Watermark the idle loop refills to
+    uint32_t hits;     // ALLOC_ZEROED requests served from the pool
+    uint32_t misses;   // ALLOC_ZEROED requests zeroed synchronously
+    uint32_t scrubbed; // Frames zeroed in idle time
+} zero_pool_stats_t;
+
+// Single frame from the buddy allocator; 0 on failure. With ALLOC_ZEROED the
+// pre-zeroed pool is tried first, falling back to zeroing on the spot.
+uint32_t alloc_page(uint32_t flags);
+
+// Scrub one batch of free frames into the pool. Returns false when the pool
+// is already full, so the caller can halt instead.
+bool zero_pool_idle(void);
+void zero_pool_set_high(uint32_t frames);
+void zero_pool_report(void);
+
+extern zero_pool_stats_t zero_pool_stats;
+
+#endif
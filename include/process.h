@@ -4,11 +4,25 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "memory/paging.h"  // Use the actual paging header
+#include "ktimer.h"
+#include "wait.h"
 
 #define MAX_PROCESSES 256
+#define PID_HASH_SIZE 1024 // Buckets in the pid lookup table, a power of two
 #define PROCESS_NAME_MAX 32
 #define KERNEL_STACK_SIZE 8192
 
+// User memory regions, backed by zeroed frames on first touch
+#define USER_HEAP_START    USER_SPACE_START
+#define USER_STACK_TOP     USER_SPACE_END
+#define USER_STACK_INITIAL 0x10000  // Reserved below the top at creation
+#define USER_STACK_MAX     0x800000 // Furthest the stack may grow down
+
+// Signal numbers, as bits in signals_pending
+#define SIGALRM 14
+
+struct fpu_state;
+
 typedef enum {
     PROCESS_RUNNING,
     PROCESS_READY,
@@ -23,6 +37,14 @@ typedef struct {
     uint32_t cr3; // Page directory
 } cpu_state_t;
 
+// A reserved range of user address space. Grow-down regions may extend
+// their start as far down as limit.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t limit;
+} vm_region_t;
+
 typedef struct process {
     uint32_t pid;
     uint32_t ppid; // Parent process ID
@@ -32,31 +54,90 @@ typedef struct process {
     cpu_state_t cpu_state;
     page_directory_t *page_directory;  // Use the actual type from paging.h
     
-    uint32_t kernel_stack;
+    uint32_t kernel_stack; // Top of this task's kernel stack
+    uint32_t kernel_sp;    // Saved stack pointer while switched out
     uint32_t user_stack;
     
-    uint32_t priority;
-    uint32_t time_slice;
-    uint32_t time_used;
+    vm_region_t heap;  // end is the program break
+    vm_region_t stack;
+    
+    struct fpu_state *fpu_state; // Saved FPU/SSE registers, allocated on first use
+    
+    uint32_t priority;        // Run queue level, PRIORITY_HIGHEST first
+    uint32_t static_priority; // Level before the interactivity bonus
+    uint32_t time_slice;      // Ticks left before its equals get a turn
+    uint32_t time_used;       // Ticks spent running
+    uint32_t utime;           // ...of which the tick found it in user mode
+    uint32_t stime;           // ...or in the kernel
+    uint64_t run_cycles;      // TSC time on a CPU, interrupts included
+    uint64_t irq_cycles;      // ...of which in interrupts it was running under
+    uint64_t wait_cycles;     // TSC time READY on a run queue
+    uint64_t ready_tsc;       // When it last became READY
+    uint32_t nvcsw;           // Switched away blocking or exiting
+    uint32_t nivcsw;          // Switched away while still runnable
+    uint32_t sleep_avg;       // Recent ticks asleep, up to SLEEP_AVG_MAX
+    uint32_t sleep_start;     // Tick it last blocked at
+    uint64_t wake_tsc;        // When it was last woken
+    
+    struct process *run_next; // Neighbours on the run queue while READY
+    struct process *run_prev;
+    uint32_t cpu;             // Whose run queue it belongs to
+    volatile bool on_cpu;     // Its stack is in use until the switch away is done
+    bool pinned;              // Never stolen by another CPU
     
-    struct process *next;
+    ktimer_t alarm;            // Armed by SYS_ALARM
+    uint32_t signals_pending;  // Raised but not yet delivered
+    
+    int exit_status;
+    wait_queue_t child_exit;   // The parent, blocked in wait()
+    
+    struct process *next;        // Neighbours on process_list
+    struct process *prev;
+    struct process *hash_next;   // Neighbours in its pid hash bucket
+    struct process *hash_prev;
     struct process *parent;
-    struct process **children;
+    struct process *children;    // Most recent child first
+    struct process *sibling_next;
+    struct process *sibling_prev;
     uint32_t child_count;
 } process_t;
 
-extern process_t *current_process;
+// A process's accounting, copied out by process_snapshot
+typedef struct {
+    uint32_t pid;
+    char name[PROCESS_NAME_MAX];
+    process_state_t state;
+    uint32_t cpu;
+    uint32_t priority;
+    uint32_t utime;
+    uint32_t stime;
+    uint64_t run_cycles;
+    uint64_t irq_cycles;
+    uint64_t wait_cycles;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+} process_sample_t;
+
+// current_process is per CPU; see sched.h
 extern process_t *process_list;
 
 // Function prototypes
 void process_init(void);
 process_t *create_process(const char *name, void (*entry_point)(void), bool kernel_mode);
 void destroy_process(process_t *proc);
+process_t *find_process(uint32_t pid);
+
+// Copy up to `max` processes' accounting in one consistent pass; returns
+// how many processes there are, which may be more
+uint32_t process_snapshot(process_sample_t *samples, uint32_t max);
+bool process_handle_fault(uint32_t virtual_addr, uint32_t error_code);
+uint32_t process_brk(process_t *proc, uint32_t addr);
+uint32_t process_alarm(process_t *proc, uint32_t seconds);
 void schedule(void);
 void switch_task(process_t *next);
 uint32_t fork(void);
 void exit(int status);
 int wait(int *status);
-void context_switch(void *prev_state, void *next_state);
+void context_switch(uint32_t *prev_sp, uint32_t next_sp);
 
 #endif
\ No newline at end of file
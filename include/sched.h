@@ -0,0 +1,164 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "process.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+
+// Lower numbers run first. Each level is one bit in the ready bitmap; the
+// last one belongs to the idle task alone.
+#define PRIORITY_LEVELS  32
+#define PRIORITY_HIGHEST 0
+#define PRIORITY_LOWEST  (PRIORITY_LEVELS - 2)
+#define PRIORITY_IDLE    (PRIORITY_LEVELS - 1)
+#define PRIORITY_DEFAULT 10
+
+#define SCHED_TIME_SLICE  10       // Ticks before a task yields to its equals
+#define SLEEP_AVG_MAX     TIMER_HZ // Sleep credit is capped at a second
+#define INTERACTIVE_BONUS 5        // Levels gained by a task that mostly sleeps
+
+// Load averages: running and ready tasks, sampled every 5 seconds into
+// exponentially decaying averages over 1, 5 and 15 minutes, in fixed
+// point with FSHIFT fraction bits. EXP_n is FIXED_1 / e^(5s / n min).
+#define FSHIFT    11
+#define FIXED_1   (1 << FSHIFT)
+#define LOAD_FREQ (5 * TIMER_HZ)
+#define EXP_1     1884
+#define EXP_5     2014
+#define EXP_15    2037
+
+typedef struct {
+    process_t *head;
+    process_t *tail;
+} run_list_t;
+
+// READY processes only; the running one is taken off when it's picked
+typedef struct {
+    uint32_t bitmap; // Bit n set while level n is non-empty
+    uint32_t nr_ready;
+    run_list_t levels[PRIORITY_LEVELS];
+} run_queue_t;
+
+typedef struct {
+    uint32_t switches;    // Context switches
+    uint32_t preemptions; // ...of which forced on the interrupt return path
+    uint32_t wakeups;
+    uint32_t steals;      // Tasks pulled over from another CPU's queue
+} sched_stats_t;
+
+// Per-CPU state, reached through %fs. Each CPU schedules from its own run
+// queue; a task stays on the queue of the CPU it last ran on until an
+// idle CPU steals it.
+typedef struct cpu {
+    struct cpu *self;          // Must stay first: this_cpu() reads %fs:0
+    process_t *current;
+    process_t *idle;           // Runs when the queue has nothing else
+    process_t *prev;           // Switched away from, until off our stack
+    uint32_t id;
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool need_resched;
+    volatile uint32_t preempt_count;
+    process_t *fpu_owner;      // Task whose registers the FPU holds
+    uint32_t kernel_fpu_flags; // EFLAGS saved by kernel_fpu_begin
+    volatile uint32_t softirq_pending; // Bit n set while softirq n is raised
+    bool in_softirq;
+    uint64_t irq_start;        // TSC at entry to the current interrupt
+    bool irq_from_user;        // The current interrupt came from ring 3
+    uint64_t irq_cycles;       // TSC time in interrupts and softirqs
+    uint64_t switch_tsc;       // Runtime charged to current up to here
+    spinlock_t lock;           // Guards run_queue and its tasks' states
+    run_queue_t run_queue;
+    sched_stats_t stats;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+extern uint32_t sched_loadavg[3];
+
+static inline cpu_t *this_cpu(void) {
+    cpu_t *cpu;
+    asm volatile("mov %%fs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// A single load, so it can't be split by a migration to another CPU
+static inline process_t *get_current(void) {
+    process_t *proc;
+    asm volatile("mov %%fs:%c1, %0" : "=r"(proc) : "i"(offsetof(cpu_t, current)));
+    return proc;
+}
+
+static inline uint32_t smp_processor_id(void) {
+    uint32_t id;
+    asm volatile("mov %%fs:%c1, %0" : "=r"(id) : "i"(offsetof(cpu_t, id)));
+    return id;
+}
+
+#define current_process (get_current())
+
+// This CPU's idle task. Idle tasks never migrate, so a task asking whether
+// it is one gets the right answer even if it moves meanwhile.
+#define idle_process    (this_cpu()->idle)
+
+// The boot thread becomes the first CPU's idle task, and each application
+// processor's starting thread its own; they only run when nothing else is
+// ready
+void sched_init(process_t *idle);
+void sched_init_cpu(cpu_t *cpu, process_t *idle);
+
+// Called on the new task's stack after every switch, to release the one
+// that was switched out
+void sched_finish_switch(void);
+
+// Sum of every CPU's counters
+void sched_stats_total(sched_stats_t *total);
+
+// Move a process between states, queueing it on entering READY and
+// unqueueing it on leaving
+void sched_set_state(process_t *proc, process_state_t state);
+bool sched_set_priority(process_t *proc, uint32_t priority);
+
+// Highest-priority ready process on this CPU's queue, oldest first within
+// a level; NULL if none
+process_t *sched_pick_next(void);
+
+// Choose what this CPU runs after `prev` and take it off the queues: the
+// best local task, else one stolen from the busiest other queue if `prev`
+// can't go on, else the idle task. NULL if `prev` should keep running.
+// Interrupts must be off.
+process_t *sched_next_task(process_t *prev);
+
+// Timer interrupt: charge the tick to the running task and end its slice
+void sched_tick(void);
+
+// Tasks running or ready on any CPU, idle tasks aside
+uint32_t sched_nr_active(void);
+
+// Boot CPU's tick: fold sched_nr_active into the load averages every
+// LOAD_FREQ ticks
+void sched_calc_load(uint32_t tick);
+
+// Block the running task until sched_wakeup. Interrupts must be off from
+// the moment the task makes itself findable by its waker until this call.
+// `held`, if given, is released once the task is marked blocked, so a
+// waker that needs it can't run before then.
+void sched_block(spinlock_t *held);
+void sched_wakeup(process_t *proc);
+
+// Block the running task until the next interrupt of any kind
+void sched_wait_interrupt(void);
+
+// Called on the way out of every hardware interrupt, after the EOI; runs
+// the bottom halves, then switches tasks if one is due
+void sched_irq_return(void);
+
+// Keep the running task on its CPU through a short critical section
+void preempt_disable(void);
+void preempt_enable(void);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_CPUS 16
+
+// Application processors start in real mode at a page-aligned address
+// below 1MB; this page sits under the EBDA and above the boot stack
+#define AP_TRAMPOLINE 0x9E000
+
+// Local APIC registers, as byte offsets from its base
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+#define LAPIC_ID           0x020
+#define LAPIC_TPR          0x080
+#define LAPIC_EOI          0x0B0
+#define LAPIC_SVR          0x0F0
+#define LAPIC_ESR          0x280
+#define LAPIC_ICR_LOW      0x300
+#define LAPIC_ICR_HIGH     0x310
+#define LAPIC_LVT_TIMER    0x320
+#define LAPIC_LVT_LINT0    0x350
+#define LAPIC_LVT_LINT1    0x360
+#define LAPIC_LVT_ERROR    0x370
+#define LAPIC_TIMER_INIT   0x380
+#define LAPIC_TIMER_COUNT  0x390
+#define LAPIC_TIMER_DIV    0x3E0
+
+#define LAPIC_SVR_ENABLE   0x100
+#define LAPIC_LVT_MASKED   0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV_16 0x3
+
+// ICR delivery modes and flags
+#define ICR_INIT           0x500
+#define ICR_STARTUP        0x600
+#define ICR_PENDING        0x1000
+#define ICR_ASSERT         0x4000
+#define ICR_LEVEL          0x8000
+
+// Interrupt vectors above the PIC's, handled with a local APIC EOI
+#define VECTOR_APIC_BASE     48
+#define VECTOR_LAPIC_TIMER   48
+#define VECTOR_RESCHEDULE    49
+#define VECTOR_TLB_SHOOTDOWN 50
+#define VECTOR_SPURIOUS      63
+
+typedef struct {
+    uint32_t cpus_found;     // Processors listed by the firmware tables
+    uint32_t ipis_sent;
+    uint32_t shootdowns;     // Kernel TLB flushes pushed to other CPUs
+    uint32_t shootdown_ipis;
+} smp_stats_t;
+
+extern smp_stats_t smp_stats;
+extern volatile uint32_t *lapic;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// Load the kernel GDT and point %fs at the boot CPU's per-CPU data; must
+// come before anything reads current_process
+void percpu_init(void);
+
+// Find the other processors in the ACPI MADT (or the MP table) and start
+// them. Needs paging, the clock and the scheduler.
+void smp_init(void);
+
+// Interrupt handlers for the local APIC vectors. A reschedule IPI needs
+// none: the sender sets need_resched and the interrupt return acts on it.
+void lapic_timer_handler(void);
+void tlb_shootdown_handler(void);
+void lapic_eoi(void);
+
+// Ask a CPU to run schedule() on its way out of the interrupt
+void smp_send_reschedule(uint32_t cpu);
+
+// Flush [start, end) of the kernel mappings on every other online CPU and
+// wait until they have. Only the shared kernel mappings need this: a user directory is
+// only ever loaded on the CPU its process is running on.
+void tlb_shootdown(uint32_t start, uint32_t end);
+
+void smp_report(void);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "interrupts/idt.h"
+
+// Bottom halves. An interrupt handler does only what can't wait (read the
+// device, acknowledge it) and raises a softirq; the rest runs on the same
+// CPU on the way out of the interrupt, after the EOI and with interrupts
+// back on. Softirq handlers must not sleep; anything that has to wait on
+// hardware or block goes to a worker thread with queue_work.
+enum {
+    SOFTIRQ_TIMER,    // Fire expired kernel timers
+    SOFTIRQ_KEYBOARD, // Turn buffered scancodes into key events
+    NR_SOFTIRQS
+};
+
+// Passes over the pending bits before the rest is left for the next
+// interrupt return or the idle loop
+#define SOFTIRQ_RESTART_MAX 10
+
+typedef struct {
+    uint32_t raised[NR_SOFTIRQS];
+    uint32_t runs[NR_SOFTIRQS];
+    uint32_t postponed;       // Passes cut short by SOFTIRQ_RESTART_MAX
+    uint64_t irq_off_max;     // Cycles, longest top half with interrupts off
+    uint64_t softirq_max;     // Cycles, longest run of bottom halves
+} softirq_stats_t;
+
+extern softirq_stats_t softirq_stats;
+
+void open_softirq(uint32_t nr, void (*handler)(void));
+
+// Mark a softirq pending on this CPU; safe from any context
+void raise_softirq(uint32_t nr);
+
+// Run this CPU's pending softirqs. Called with interrupts off, which are
+// turned on while the handlers run and off again on return. Nested calls,
+// from interrupts taken meanwhile, return straight away.
+void do_softirq(void);
+
+bool softirq_pending(void);
+
+// First and last thing on every hardware interrupt: time the top half,
+// run whatever it raised and charge the interrupt to the running task
+void irq_enter(interrupt_frame_t *frame);
+void irq_exit(void);
+
+// Run bottom halves inside the top half with interrupts off, as interrupt
+// handlers used to, for comparing the time spent with interrupts off
+void softirq_set_deferred(bool deferred);
+bool softirq_deferred(void);
+void softirq_reset_max(void);
+
+void softirq_report(void);
+
+#endif
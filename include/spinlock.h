@@ -0,0 +1,67 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+// Ticket lock: a locker takes the next ticket and spins until the owner
+// count reaches it, so CPUs get the lock in the order they asked for it.
+// Holders must keep interrupts off if a handler on the same CPU could take
+// the lock too.
+typedef struct {
+    volatile uint16_t next;
+    volatile uint16_t owner;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+
+// Answer requests other CPUs are waiting on; called while spinning, since
+// the spinner may have interrupts off
+void smp_poll(void);
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->next = 0;
+    lock->owner = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    while (lock->owner != ticket) {
+        cpu_relax();
+        smp_poll();
+    }
+    asm volatile("" : : : "memory");
+}
+
+// Take the lock only if nobody holds or is waiting for it
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint16_t owner = lock->owner;
+    uint32_t old = (uint32_t)owner << 16 | owner;
+    uint32_t new = (uint32_t)owner << 16 | (uint16_t)(owner + 1);
+    return __sync_bool_compare_and_swap((volatile uint32_t*)lock, old, new);
+}
+
+// x86 doesn't reorder stores with older loads or stores, so the critical
+// section is visible before the owner count moves on
+static inline void spin_unlock(spinlock_t *lock) {
+    asm volatile("" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return lock->next != lock->owner;
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
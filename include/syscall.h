@@ -54,7 +54,7 @@
 typedef uint32_t (*syscall_handler_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
 
 void syscall_init(void);
-void syscall_handler(void);
+uint32_t syscall_handler(uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx);
 uint32_t syscall_dispatch(uint32_t call_num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
 
 uint32_t sys_exit(uint32_t status);
@@ -65,5 +65,9 @@ uint32_t sys_open(uint32_t pathname, uint32_t flags, uint32_t mode);
 uint32_t sys_close(uint32_t fd);
 uint32_t sys_getpid(void);
 uint32_t sys_brk(uint32_t addr);
+uint32_t sys_getpriority(uint32_t pid);
+uint32_t sys_setpriority(uint32_t pid, uint32_t priority);
+uint32_t sys_time(uint32_t ns_out);
+uint32_t sys_alarm(uint32_t seconds);
 
 #endif
@@ -2,13 +2,36 @@
 #define TIMER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define PIT_FREQUENCY 1193180
 #define TIMER_IRQ 0
+#define TIMER_HZ 100
+
+// Longest one-shot the 16-bit PIT counter can time, about 55ms
+#define PIT_ONESHOT_MAX 0xFFFF
+
+typedef struct {
+    uint32_t busy_ticks;   // Timer interrupts while a task was running
+    uint32_t idle_wakeups; // Interrupts of any kind that ended an idle halt
+    uint32_t oneshots;     // Idle halts with the periodic tick stopped
+    uint32_t caught_up;    // Ticks accounted on wakeup instead of taken
+    uint64_t idle_ns;      // Time spent halted
+} timer_stats_t;
+
+extern timer_stats_t timer_stats;
 
 void timer_init(uint32_t frequency);
 void timer_handler(void);
 uint32_t get_tick_count(void);
 void sleep(uint32_t milliseconds);
 
-#endif
\ No newline at end of file
+// Tickless idle: the idle task halts with the PIT in one-shot mode, timed
+// to the next kernel timer, and the first interrupt to arrive puts
+// the periodic tick back and accounts for the ticks that were skipped
+void timer_idle_enter(void);
+void timer_irq_enter(void);
+void timer_set_tickless(bool enabled);
+void timer_report(void);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef TOP_H
+#define TOP_H
+
+#include <stdint.h>
+
+#define TOP_ROWS        20   // Busiest processes shown per refresh
+#define TOP_INTERVAL_MS 1000
+#define TOP_SLACK       32   // Room for processes created between refreshes
+
+// Show the processes using the most CPU over each interval, with their
+// accounting and the load averages. Runs for `refreshes` intervals, or
+// until a key is pressed if that is 0.
+void top_run(uint32_t refreshes);
+
+#endif
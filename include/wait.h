@@ -0,0 +1,56 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "spinlock.h"
+
+struct process;
+
+// A task blocked on a queue, linked in from its own stack
+typedef struct wait_entry {
+    struct process *proc;
+    struct wait_entry *next;
+    struct wait_entry *prev;
+} wait_entry_t;
+
+// Tasks waiting for an event, oldest first
+typedef struct {
+    wait_entry_t *head;
+    wait_entry_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { NULL, NULL }
+
+// Guards every wait queue. Waiters hold it from checking their condition
+// until they are queued and marked blocked, so a wake_up on another CPU
+// can't slip in between.
+extern spinlock_t wait_lock;
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Block the running task on the queue until the next wake_up. Called with
+// wait_lock held and interrupts off, so the event can't come between the
+// caller's last check and the task going to sleep; the lock is dropped
+// while asleep and held again on return. The idle task can't block and
+// halts until the next interrupt instead.
+void wait_sleep(wait_queue_t *wq);
+
+// Make every task on the queue ready; safe from interrupt handlers
+void wake_up(wait_queue_t *wq);
+
+// Sleep on the queue until the condition holds. Wakers change the state
+// the condition reads before calling wake_up; a task woken for anything
+// else just checks again.
+#define wait_event(wq, condition)                            \
+    do {                                                     \
+        uint32_t __wait_irq = spin_lock_irqsave(&wait_lock); \
+        while (!(condition)) {                               \
+            wait_sleep(wq);                                  \
+        }                                                    \
+        spin_unlock_irqrestore(&wait_lock, __wait_irq);      \
+    } while (0)
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Deferred work in process context. Items queued from anywhere, including
+// interrupt handlers, are run in order by a pool of kernel threads, which
+// may sleep, block on hardware or allocate like any other task.
+#define WORKQUEUE_MAX_WORKERS 16
+#define WORKER_PRIORITY       5 // Ahead of ordinary tasks, so work isn't starved
+
+typedef struct work {
+    void (*func)(struct work *work);
+    void *data;
+    struct work *next;
+    volatile bool pending;  // Queued and not yet started
+    uint64_t queued_tsc;
+} work_t;
+
+typedef struct {
+    uint32_t workers;
+    uint32_t queued;
+    uint32_t run;
+    uint32_t requeued;      // queue_work on an item already pending
+    uint64_t wait_max;      // Cycles, longest from queueing to starting
+} workqueue_stats_t;
+
+extern workqueue_stats_t workqueue_stats;
+
+void work_init(work_t *work, void (*func)(work_t *work), void *data);
+
+// Queue an item to run once; false if it is already waiting. An item may
+// be queued again as soon as its function has started.
+bool queue_work(work_t *work);
+
+// Start one worker thread per online CPU
+void workqueue_init(void);
+
+void workqueue_report(void);
+
+#endif
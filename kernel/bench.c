@@ -0,0 +1,767 @@
+#include "bench.h"
+#include "kernel.h"
+#include "process.h"
+#include "sched.h"
+#include "memory/paging.h"
+#include "memory/buddy.h"
+#include "fpu.h"
+#include "cpu.h"
+#include "clock.h"
+#include "ktimer.h"
+#include "wait.h"
+#include "smp.h"
+#include "softirq.h"
+#include <string.h>
+#include <stddef.h>
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run)(void);
+} bench_t;
+
+#define BENCH_FORK_PAGES  1024 // 4MB heap in the forking process
+#define BENCH_FORK_STRIDE 8    // Parent dirties every 8th page after fork
+
+// Fork a process with a populated heap, then dirty part of it to measure
+// what copy-on-write defers and what it eventually has to copy
+static void bench_fork(void) {
+    cpu_t *cpu = this_cpu();
+    process_t *saved = cpu->current;
+    process_t *parent = create_process("forkbench", NULL, false);
+    if (!parent) {
+        printf("bench: cannot create process\n");
+        return;
+    }
+
+    // Nothing else may run while the forking process stands in for this one
+    uint32_t irq = irq_save();
+    switch_page_directory(parent->page_directory);
+    for (uint32_t i = 0; i < BENCH_FORK_PAGES; i++) {
+        uint32_t addr = USER_SPACE_START + i * PAGE_SIZE;
+        alloc_frame(addr, false, true);
+        *(volatile uint32_t*)addr = i;
+    }
+    cpu->current = parent;
+
+    uint32_t copied = cow_stats.copied;
+    uint64_t start = rdtsc();
+    uint32_t pid = fork();
+    uint64_t forked = rdtsc();
+
+    uint32_t writes = 0;
+    for (uint32_t i = 0; i < BENCH_FORK_PAGES; i += BENCH_FORK_STRIDE) {
+        *(volatile uint32_t*)(USER_SPACE_START + i * PAGE_SIZE) = ~i;
+        writes++;
+    }
+    uint64_t touched = rdtsc();
+    copied = cow_stats.copied - copied;
+
+    // What an eager fork would have spent copying the same heap
+    uint32_t scratch = alloc_pages(0);
+    uint64_t eager_start = rdtsc();
+    for (uint32_t i = 0; scratch && i < BENCH_FORK_PAGES; i++) {
+        memcpy((void*)scratch, (void*)(USER_SPACE_START + i * PAGE_SIZE), PAGE_SIZE);
+    }
+    uint64_t eager_end = rdtsc();
+    if (scratch) free_pages(scratch, 0);
+
+    cpu->current = saved;
+    switch_page_directory(saved ? saved->page_directory : kernel_directory);
+    destroy_process(find_process(pid));
+    destroy_process(parent);
+    irq_restore(irq);
+
+    uint32_t fork_cycles = (uint32_t)(forked - start);
+    uint32_t fault_cycles = (uint32_t)(touched - forked);
+    printf("fork: %u pages shared in %u cycles (%u cycles/page)\n",
+           BENCH_FORK_PAGES, fork_cycles, fork_cycles / BENCH_FORK_PAGES);
+    printf("cow:  %u writes, %u pages copied, %u cycles/fault\n",
+           writes, copied, writes ? fault_cycles / writes : 0);
+    printf("eager copy of the same heap: %u cycles\n", (uint32_t)(eager_end - eager_start));
+}
+
+#define BENCH_TLB_BLOCKS 8 // 4MB buddy blocks swept per pass
+#define BENCH_TLB_PASSES 4
+
+// Sweep the blocks with memset, then read one word per page so that nearly
+// every access needs a fresh translation
+static uint32_t tlb_sweep(const uint32_t *blocks, uint32_t count) {
+    uint64_t start = rdtsc();
+    for (uint32_t pass = 0; pass < BENCH_TLB_PASSES; pass++) {
+        for (uint32_t b = 0; b < count; b++) {
+            memset((void*)blocks[b], pass, LARGE_PAGE_SIZE);
+        }
+        uint32_t sum = 0;
+        for (uint32_t offset = 0; offset < LARGE_PAGE_SIZE; offset += PAGE_SIZE) {
+            for (uint32_t b = 0; b < count; b++) {
+                sum += *(volatile uint32_t*)(blocks[b] + offset);
+            }
+        }
+        (void)sum;
+    }
+    return (uint32_t)(rdtsc() - start);
+}
+
+// The same TLB-heavy sweep through the kernel's 4MB identity mapping and
+// through a copy of it split into 4KB pages
+static void bench_tlb(void) {
+    uint32_t blocks[BENCH_TLB_BLOCKS];
+    uint32_t count = 0;
+    while (count < BENCH_TLB_BLOCKS) {
+        uint32_t block = alloc_pages(BUDDY_MAX_ORDER);
+        if (!block) break;
+        blocks[count++] = block;
+    }
+    if (count == 0) {
+        printf("bench: no free 4MB blocks\n");
+        return;
+    }
+
+    page_directory_t *small = create_page_directory();
+    bool split = small != NULL;
+    for (uint32_t b = 0; split && b < count; b++) {
+        split = split_large_page(small, blocks[b]);
+    }
+
+    uint32_t large_cycles = tlb_sweep(blocks, count);
+    uint32_t small_cycles = 0;
+    if (split) {
+        // The 4MB entries are global and would outlive the CR3 switch
+        switch_page_directory(small);
+        tlb_flush_all();
+        small_cycles = tlb_sweep(blocks, count);
+        switch_page_directory(current_process ? current_process->page_directory : kernel_directory);
+        tlb_flush_all();
+    }
+    destroy_page_directory(small);
+    for (uint32_t b = 0; b < count; b++) {
+        free_pages(blocks[b], BUDDY_MAX_ORDER);
+    }
+
+    printf("tlb: %u MB x %u passes\n", count * (LARGE_PAGE_SIZE >> 20), BENCH_TLB_PASSES);
+    printf("4MB pages: %u cycles\n", large_cycles);
+    if (split) {
+        printf("4KB pages: %u cycles\n", small_cycles);
+    } else {
+        printf("4KB pages: unavailable (identity map is not using 4MB pages)\n");
+    }
+}
+
+#define BENCH_MEM_ORDER  8         // 1MB source and destination buffers
+#define BENCH_MEM_VOLUME 0x400000  // Bytes copied per size
+
+// The byte-at-a-time loop the string routines replaced. The volatile
+// destination stops the compiler from turning it back into a memcpy call.
+static void byte_copy(void *dest, const void *src, uint32_t n) {
+    volatile uint8_t *d = (volatile uint8_t*)dest;
+    const uint8_t *s = (const uint8_t*)src;
+    for (uint32_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+}
+
+static uint32_t bytes_per_kcycle(uint32_t bytes, uint32_t cycles) {
+    cycles /= 1000;
+    return cycles ? bytes / cycles : 0;
+}
+
+// Copy throughput from 16 bytes to 1MB, memcpy against a byte loop
+static void bench_mem(void) {
+    uint32_t src = alloc_pages(BENCH_MEM_ORDER);
+    uint32_t dst = alloc_pages(BENCH_MEM_ORDER);
+    if (!src || !dst) {
+        printf("bench: cannot allocate copy buffers\n");
+        if (src) free_pages(src, BENCH_MEM_ORDER);
+        if (dst) free_pages(dst, BENCH_MEM_ORDER);
+        return;
+    }
+    memset((void*)src, 0x5A, PAGE_SIZE << BENCH_MEM_ORDER);
+
+    printf("size\tmemcpy\tbytes\tcycles\tbytes/kcycle\n");
+    for (uint32_t size = 16; size <= (PAGE_SIZE << BENCH_MEM_ORDER); size <<= 2) {
+        uint32_t rounds = BENCH_MEM_VOLUME / size;
+
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < rounds; i++) {
+            memcpy((void*)dst, (void*)src, size);
+        }
+        uint32_t fast = (uint32_t)(rdtsc() - start);
+
+        start = rdtsc();
+        for (uint32_t i = 0; i < rounds; i++) {
+            byte_copy((void*)dst, (void*)src, size);
+        }
+        uint32_t slow = (uint32_t)(rdtsc() - start);
+
+        printf("%u\trep\t%u\t%u\t%u\n", size, BENCH_MEM_VOLUME, fast,
+               bytes_per_kcycle(BENCH_MEM_VOLUME, fast));
+        printf("%u\tbyte\t%u\t%u\t%u\n", size, BENCH_MEM_VOLUME, slow,
+               bytes_per_kcycle(BENCH_MEM_VOLUME, slow));
+    }
+
+    free_pages(src, BENCH_MEM_ORDER);
+    free_pages(dst, BENCH_MEM_ORDER);
+}
+
+#define BENCH_SSE_PAGES  1024      // Pages zeroed per run
+#define BENCH_SSE_COPY   0x10000   // 64KB copies
+#define BENCH_SSE_ROUNDS 64
+
+// Page zeroing and 64KB copies, scalar string instructions against SSE2.
+// Each SSE operation pays for its own kernel FPU section.
+static void bench_sse(void) {
+    if (!sse2_available()) {
+        printf("bench: SSE2 not available\n");
+        return;
+    }
+    uint32_t buffer = alloc_pages(BUDDY_MAX_ORDER);
+    if (!buffer) {
+        printf("bench: cannot allocate buffer\n");
+        return;
+    }
+    memset((void*)buffer, 0xA5, BENCH_SSE_PAGES * PAGE_SIZE);
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SSE_PAGES; i++) {
+        memset((void*)(buffer + i * PAGE_SIZE), 0, PAGE_SIZE);
+    }
+    uint32_t zero_scalar = (uint32_t)(rdtsc() - start);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SSE_PAGES; i++) {
+        kernel_fpu_begin();
+        sse_zero_page((void*)(buffer + i * PAGE_SIZE));
+        kernel_fpu_end();
+    }
+    uint32_t zero_sse = (uint32_t)(rdtsc() - start);
+
+    void *src = (void*)buffer;
+    void *dst = (void*)(buffer + BENCH_SSE_COPY);
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SSE_ROUNDS; i++) {
+        memcpy(dst, src, BENCH_SSE_COPY);
+    }
+    uint32_t copy_scalar = (uint32_t)(rdtsc() - start);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SSE_ROUNDS; i++) {
+        kernel_fpu_begin();
+        sse_memcpy(dst, src, BENCH_SSE_COPY);
+        kernel_fpu_end();
+    }
+    uint32_t copy_sse = (uint32_t)(rdtsc() - start);
+
+    free_pages(buffer, BUDDY_MAX_ORDER);
+
+    printf("operation\tscalar\tsse2\t(cycles per op)\n");
+    printf("zero page\t%u\t%u\n", zero_scalar / BENCH_SSE_PAGES, zero_sse / BENCH_SSE_PAGES);
+    printf("copy 64KB\t%u\t%u\n", copy_scalar / BENCH_SSE_ROUNDS, copy_sse / BENCH_SSE_ROUNDS);
+}
+
+#define BENCH_SCHED_ROUNDS 10000
+
+// The list walk schedule() used before the run queues: the next READY
+// process after `from` in process_list order
+static process_t *walk_next_ready(process_t *from) {
+    process_t *next = from->next ? from->next : process_list;
+    while (next != from && next->state != PROCESS_READY) {
+        next = next->next ? next->next : process_list;
+    }
+    return next;
+}
+
+// Cycles per pick over BENCH_SCHED_ROUNDS, each pick rotating the chosen
+// process to the back as a switch would
+static uint32_t time_queue_picks(void) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SCHED_ROUNDS; i++) {
+        process_t *next = sched_pick_next();
+        sched_set_state(next, PROCESS_RUNNING);
+        sched_set_state(next, PROCESS_READY);
+    }
+    return (uint32_t)(rdtsc() - start) / BENCH_SCHED_ROUNDS;
+}
+
+static uint32_t time_walk_picks(process_t *cursor) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SCHED_ROUNDS; i++) {
+        cursor = walk_next_ready(cursor);
+    }
+    return (uint32_t)(rdtsc() - start) / BENCH_SCHED_ROUNDS;
+}
+
+// Pick-next cost with MAX_PROCESSES tasks spread over every priority level,
+// first all ready and then with most of them blocked. The tasks have nothing
+// to run, so the timer must not get to switch to them and no other CPU may
+// take them.
+static void bench_sched(void) {
+    static process_t *tasks[MAX_PROCESSES];
+    uint32_t irq = irq_save();
+    uint32_t count = 0;
+    while (count < MAX_PROCESSES) {
+        process_t *task = create_process("schedbench", NULL, true);
+        if (!task) break;
+        task->pinned = true;
+        sched_set_priority(task, count % PRIORITY_LEVELS);
+        tasks[count++] = task;
+    }
+    if (count < MAX_PROCESSES) {
+        printf("bench: only created %u tasks\n", count);
+    }
+
+    printf("tasks\tready\trunqueue\tlist walk\t(cycles per pick)\n");
+    for (uint32_t ready_every = 1; ready_every <= 16; ready_every *= 16) {
+        for (uint32_t i = 0; i < count; i++) {
+            sched_set_state(tasks[i], i % ready_every ? PROCESS_BLOCKED : PROCESS_READY);
+        }
+        uint32_t queue = time_queue_picks();
+        uint32_t walk = time_walk_picks(tasks[0]);
+        printf("%u\t%u\t%u\t\t%u\n", count, this_cpu()->run_queue.nr_ready, queue, walk);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        destroy_process(tasks[i]);
+    }
+    irq_restore(irq);
+}
+
+#define BENCH_LATENCY_HOGS  4
+#define BENCH_LATENCY_SHIFT 8 // 256 wakeups per run
+#define BENCH_LATENCY_WAKEUPS (1u << BENCH_LATENCY_SHIFT)
+
+static volatile bool hogs_running;
+static volatile uint32_t hog_loops;
+
+static void latency_hog(void) {
+    while (hogs_running) {
+        hog_loops++;
+    }
+}
+
+// Wait for the next interrupt repeatedly, timing each wakeup to the moment
+// this task is running again. A keystroke reaches a shell waiting for input
+// along the same path.
+static void measure_wakeups(uint32_t *avg, uint32_t *max) {
+    uint64_t total = 0;
+    *max = 0;
+    for (uint32_t i = 0; i < BENCH_LATENCY_WAKEUPS; i++) {
+        sched_wait_interrupt();
+        uint32_t latency = (uint32_t)(rdtsc() - current_process->wake_tsc);
+        total += latency;
+        if (latency > *max) *max = latency;
+    }
+    *avg = (uint32_t)(total >> BENCH_LATENCY_SHIFT);
+}
+
+// Wakeup latency on an idle system and with CPU-bound tasks at the same
+// static priority competing for the processor
+static void bench_latency(void) {
+    if (current_process == idle_process) {
+        printf("bench: the idle task cannot block\n");
+        return;
+    }
+
+    uint32_t avg, max;
+    printf("hogs\tavg\tmax\t(cycles from wakeup to running)\n");
+    measure_wakeups(&avg, &max);
+    printf("0\t%u\t%u\n", avg, max);
+
+    process_t *hogs[BENCH_LATENCY_HOGS];
+    uint32_t count = 0;
+    hogs_running = true;
+    hog_loops = 0;
+    while (count < BENCH_LATENCY_HOGS) {
+        process_t *hog = create_process("hog", latency_hog, true);
+        if (!hog) break;
+        hogs[count++] = hog;
+    }
+
+    sched_stats_t before, after;
+    sched_stats_total(&before);
+    measure_wakeups(&avg, &max);
+    sched_stats_total(&after);
+    uint32_t preemptions = after.preemptions - before.preemptions;
+    printf("%u\t%u\t%u\n", count, avg, max);
+    printf("hogs looped %u times, %u preemptions\n", hog_loops, preemptions);
+    printf("this task at level %u, static priority %u\n",
+           current_process->priority, current_process->static_priority);
+
+    // Let the hogs see the flag and exit before reclaiming them
+    hogs_running = false;
+    for (uint32_t i = 0; i < count; i++) {
+        while (hogs[i]->state != PROCESS_TERMINATED) {
+            sched_wait_interrupt();
+        }
+        destroy_process(hogs[i]);
+    }
+}
+
+#define BENCH_SWITCH_ROUNDS 10000
+
+static volatile uint32_t ping_cycles;
+
+// Two tasks at the top priority level yield to each other, so each round
+// trip is exactly two switches
+static void switch_ping(void) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        schedule();
+    }
+    ping_cycles = (uint32_t)(rdtsc() - start);
+}
+
+static void switch_pong(void) {
+    for (uint32_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        schedule();
+    }
+}
+
+// Cycles per switch between a ping-pong pair, both made ready before either
+// can run. Returns 0 if the pair could not be created.
+static uint32_t time_pingpong(bool kernel_mode, uint32_t *cr3_loads) {
+    uint32_t irq = irq_save();
+    process_t *ping = create_process("ping", switch_ping, kernel_mode);
+    process_t *pong = create_process("pong", switch_pong, kernel_mode);
+    if (!ping || !pong) {
+        if (ping) destroy_process(ping);
+        if (pong) destroy_process(pong);
+        irq_restore(irq);
+        return 0;
+    }
+    // Kept on this CPU, or each would spin through its rounds alone
+    ping->pinned = true;
+    pong->pinned = true;
+    sched_set_priority(ping, PRIORITY_HIGHEST);
+    sched_set_priority(pong, PRIORITY_HIGHEST);
+    ping_cycles = 0;
+    uint32_t loads = tlb_stats.cr3_loads;
+    irq_restore(irq);
+
+    // Both outrank this task, which runs again once they have exited
+    schedule();
+    while (ping->state != PROCESS_TERMINATED || pong->state != PROCESS_TERMINATED) {
+        sched_wait_interrupt();
+    }
+    *cr3_loads = tlb_stats.cr3_loads - loads;
+    destroy_process(ping);
+    destroy_process(pong);
+    return ping_cycles / (2 * BENCH_SWITCH_ROUNDS);
+}
+
+// Switch cost between kernel threads sharing a directory, where the CR3
+// load is skipped, and between tasks with their own address spaces
+static void bench_switch(void) {
+    if (current_process == idle_process) {
+        printf("bench: the idle task cannot block\n");
+        return;
+    }
+
+    printf("address space\tcycles\tcr3 loads\t(%u round trips)\n", BENCH_SWITCH_ROUNDS);
+    uint32_t loads;
+    uint32_t shared = time_pingpong(true, &loads);
+    printf("shared\t\t%u\t%u\n", shared, loads);
+    uint32_t separate = time_pingpong(false, &loads);
+    printf("separate\t%u\t%u\n", separate, loads);
+}
+
+#define BENCH_TIMERS      4096
+#define BENCH_TIMER_SPAN  300  // Ticks, so some start a level up the wheel
+#define BENCH_SLEEPERS    64
+
+static ktimer_t stress_timers[BENCH_TIMERS];
+static volatile uint32_t timers_fired;
+static volatile uint32_t timers_early;
+static volatile uint32_t timers_late_max;
+
+static void bench_timer_fired(ktimer_t *timer) {
+    uint32_t late = get_tick_count() - timer->expires;
+    if ((int32_t)late < 0) {
+        timers_early++;
+    } else if (late > timers_late_max) {
+        timers_late_max = late;
+    }
+    timers_fired++;
+}
+
+static volatile uint32_t sleepers_done;
+static volatile uint32_t oversleep_max_us;
+static volatile uint64_t oversleep_total_us;
+static uint32_t sleeper_seed;
+
+// Each sleeper takes a different nap, between 1 and 160ms
+static void bench_sleeper(void) {
+    uint32_t ms = (current_process->pid * 37 + sleeper_seed) % 160 + 1;
+    uint64_t start = clock_ns();
+    sleep(ms);
+    uint64_t slept = clock_ns() - start;
+    uint64_t wanted = (uint64_t)ms * NSEC_PER_MSEC;
+    uint32_t over_us = slept > wanted ? (uint32_t)div_u64(slept - wanted, NSEC_PER_USEC, NULL) : 0;
+    uint32_t irq = irq_save();
+    oversleep_total_us += over_us;
+    if (over_us > oversleep_max_us) oversleep_max_us = over_us;
+    sleepers_done++;
+    irq_restore(irq);
+}
+
+// Thousands of timers armed at once, a quarter of them cancelled, then
+// tasks all asleep at the same time
+static void bench_timers(void) {
+    if (current_process == idle_process) {
+        printf("bench: the idle task cannot block\n");
+        return;
+    }
+
+    timers_fired = 0;
+    timers_early = 0;
+    timers_late_max = 0;
+    uint32_t now = get_tick_count();
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i++) {
+        ktimer_init(&stress_timers[i], bench_timer_fired, NULL);
+        ktimer_add(&stress_timers[i], now + 1 + (i * 7919) % BENCH_TIMER_SPAN);
+    }
+    uint32_t add_cycles = (uint32_t)(rdtsc() - start) / BENCH_TIMERS;
+
+    uint32_t cancelled = 0;
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i += 4) {
+        if (ktimer_cancel(&stress_timers[i])) cancelled++;
+    }
+    uint32_t cancel_cycles = (uint32_t)(rdtsc() - start) / (BENCH_TIMERS / 4);
+
+    uint32_t cascaded = ktimer_stats.cascaded;
+    while (timers_fired + cancelled < BENCH_TIMERS) {
+        sched_wait_interrupt();
+    }
+    printf("timers\tadd\tcancel\t(cycles each)\n");
+    printf("%u\t%u\t%u\n", BENCH_TIMERS, add_cycles, cancel_cycles);
+    printf("fired %u, cancelled %u, early %u, latest %u ticks late, %u cascaded\n",
+           timers_fired, cancelled, timers_early, timers_late_max,
+           ktimer_stats.cascaded - cascaded);
+
+    process_t *sleepers[BENCH_SLEEPERS];
+    uint32_t count = 0;
+    sleepers_done = 0;
+    oversleep_max_us = 0;
+    oversleep_total_us = 0;
+    sleeper_seed = get_tick_count();
+    while (count < BENCH_SLEEPERS) {
+        process_t *sleeper = create_process("sleeper", bench_sleeper, true);
+        if (!sleeper) break;
+        sleepers[count++] = sleeper;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        while (sleepers[i]->state != PROCESS_TERMINATED) {
+            sched_wait_interrupt();
+        }
+        destroy_process(sleepers[i]);
+    }
+    printf("sleepers\tavg over\tmax over\t(us past the requested time)\n");
+    printf("%u\t\t%u\t\t%u\n", sleepers_done,
+           sleepers_done ? (uint32_t)div_u64(oversleep_total_us, sleepers_done, NULL) : 0,
+           oversleep_max_us);
+}
+
+// Worst time with interrupts off while every stress timer fires on the
+// same tick, with the callbacks run inside the timer interrupt as before
+// bottom halves, then deferred to the timer softirq
+static void bench_irqoff(void) {
+    if (current_process == idle_process) {
+        printf("bench: the idle task cannot block\n");
+        return;
+    }
+
+    bool was_deferred = softirq_deferred();
+    printf("bottom halves\tirqs off\t\tsoftirq\t(worst cycles, %u timers on one tick)\n",
+           BENCH_TIMERS);
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        bool deferred = pass == 1;
+        softirq_set_deferred(deferred);
+        timers_fired = 0;
+        uint32_t due = get_tick_count() + 2;
+        for (uint32_t i = 0; i < BENCH_TIMERS; i++) {
+            ktimer_init(&stress_timers[i], bench_timer_fired, NULL);
+            ktimer_add(&stress_timers[i], due);
+        }
+        softirq_reset_max();
+        while (timers_fired < BENCH_TIMERS) {
+            sched_wait_interrupt();
+        }
+        printf("%s\t%u\t\t%u\n", deferred ? "deferred" : "in top half",
+               (uint32_t)softirq_stats.irq_off_max, (uint32_t)softirq_stats.softirq_max);
+    }
+    softirq_set_deferred(was_deferred);
+}
+
+#define BENCH_PROCS      10000
+#define BENCH_PROCS_STEP 1000
+#define BENCH_PROCS_FINDS 1000
+
+static process_t *procbench[BENCH_PROCS];
+
+// The list walk find_process used before the pid hash
+static process_t *walk_find(uint32_t pid) {
+    for (process_t *proc = process_list; proc; proc = proc->next) {
+        if (proc->pid == pid) return proc;
+    }
+    return NULL;
+}
+
+// Cycles per lookup of live pids spread over the whole population
+static uint32_t time_finds(uint32_t count, process_t *(*find)(uint32_t)) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_PROCS_FINDS; i++) {
+        if (!find(procbench[(i * 7919) % count]->pid)) break;
+    }
+    return (uint32_t)(rdtsc() - start) / BENCH_PROCS_FINDS;
+}
+
+// Create, look up and destroy processes as the population grows to 10k.
+// The processes never run; each costs a kernel stack, so the run stops
+// early if memory runs out.
+static void bench_procs(void) {
+    printf("procs\tcreate\tfind\twalk\t(cycles each)\n");
+    uint32_t count = 0;
+    while (count < BENCH_PROCS) {
+        uint32_t step = 0;
+        uint64_t start = rdtsc();
+        while (step < BENCH_PROCS_STEP) {
+            process_t *proc = create_process("procbench", NULL, true);
+            if (!proc) break;
+            procbench[count + step++] = proc;
+        }
+        uint32_t create = step ? (uint32_t)(rdtsc() - start) / step : 0;
+        count += step;
+        if (!step) break;
+        printf("%u\t%u\t%u\t%u\n", count, create,
+               time_finds(count, find_process), time_finds(count, walk_find));
+        if (step < BENCH_PROCS_STEP) break;
+    }
+    if (count < BENCH_PROCS) {
+        printf("bench: only created %u processes\n", count);
+    }
+
+    // Destroy in an order unrelated to creation, so nothing is at a list end
+    uint32_t destroyed = 0;
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = (i * 7919) % count;
+        if (procbench[index]) {
+            destroy_process(procbench[index]);
+            procbench[index] = NULL;
+            destroyed++;
+        }
+    }
+    uint32_t destroy = destroyed ? (uint32_t)(rdtsc() - start) / destroyed : 0;
+    // The stride skips some slots when it shares a factor with count
+    for (uint32_t i = 0; i < count; i++) {
+        if (procbench[i]) {
+            destroy_process(procbench[i]);
+            procbench[i] = NULL;
+        }
+    }
+    printf("destroy\t%u\t(cycles each, from %u down)\n", destroy, count);
+}
+
+#define BENCH_SMP_ROUNDS 20000000 // xorshift steps per worker
+
+static volatile uint32_t smp_workers_done;
+static volatile uint32_t smp_sink;
+static wait_queue_t smp_done_wq = WAIT_QUEUE_INIT;
+
+// Pure CPU work with no shared state until the end
+static void smp_worker(void) {
+    uint32_t x = current_process->pid | 1;
+    for (uint32_t i = 0; i < BENCH_SMP_ROUNDS; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    __sync_fetch_and_add(&smp_sink, x);
+    __sync_fetch_and_add(&smp_workers_done, 1);
+    wake_up(&smp_done_wq);
+}
+
+// Wall time for k workers doing the same work each, k = 1..CPUs. With
+// idle CPUs stealing them, k workers should take about as long as one.
+static uint64_t time_smp_workers(uint32_t k) {
+    process_t *workers[MAX_CPUS];
+    uint32_t count = 0;
+    smp_workers_done = 0;
+    uint64_t start = clock_ns();
+    while (count < k) {
+        process_t *worker = create_process("smpwork", smp_worker, true);
+        if (!worker) break;
+        workers[count++] = worker;
+    }
+    wait_event(&smp_done_wq, smp_workers_done == count);
+    uint64_t elapsed = clock_ns() - start;
+
+    for (uint32_t i = 0; i < count; i++) {
+        while (workers[i]->state != PROCESS_TERMINATED) {
+            sched_wait_interrupt();
+        }
+        destroy_process(workers[i]);
+    }
+    return count == k ? elapsed : 0;
+}
+
+static void bench_smp(void) {
+    if (current_process == idle_process) {
+        printf("bench: the idle task cannot block\n");
+        return;
+    }
+
+    printf("%u CPUs online\n", cpu_count);
+    printf("workers\tms\tspeedup\tsteals\n");
+    uint32_t t1 = 0;
+    for (uint32_t k = 1; k <= cpu_count; k++) {
+        sched_stats_t before, after;
+        sched_stats_total(&before);
+        uint32_t ms = (uint32_t)div_u64(time_smp_workers(k), NSEC_PER_MSEC, NULL);
+        sched_stats_total(&after);
+        if (!ms) {
+            printf("bench: could not run %u workers\n", k);
+            return;
+        }
+        if (k == 1) t1 = ms;
+        uint32_t speedup = k * t1 * 100 / ms; // Hundredths
+        printf("%u\t%u\t%u.%u%u\t%u\n", k, ms, speedup / 100, speedup / 10 % 10, speedup % 10,
+               after.steals - before.steals);
+    }
+}
+
+static const bench_t benchmarks[] = {
+    { "fork", "copy-on-write fork of a 4MB heap", bench_fork },
+    { "tlb", "memset and page-stride reads, 4MB vs 4KB pages", bench_tlb },
+    { "mem", "memcpy throughput from 16B to 1MB against a byte loop", bench_mem },
+    { "sse", "page zeroing and 64KB copies, scalar vs SSE2", bench_sse },
+    { "sched", "pick-next with 256 tasks, run queues vs a list walk", bench_sched },
+    { "latency", "wakeup latency with and without CPU hogs running", bench_latency },
+    { "switch", "ping-pong context switches, shared vs separate address spaces", bench_switch },
+    { "timers", "4096 concurrent kernel timers and 64 sleeping tasks", bench_timers },
+    { "irqoff", "worst interrupts-off time, bottom halves inline vs deferred", bench_irqoff },
+    { "procs", "create, find and destroy up to 10k processes", bench_procs },
+    { "smp", "CPU-bound workers on 1 to N CPUs, wall time and speedup", bench_smp },
+};
+
+#define BENCH_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+void bench_list(void) {
+    printf("Available benchmarks:\n");
+    for (uint32_t i = 0; i < BENCH_COUNT; i++) {
+        printf("  %s\t- %s\n", benchmarks[i].name, benchmarks[i].description);
+    }
+}
+
+void bench_run(const char *name) {
+    for (uint32_t i = 0; i < BENCH_COUNT; i++) {
+        if (strcmp(name, benchmarks[i].name) == 0) {
+            benchmarks[i].run();
+            return;
+        }
+    }
+    printf("Unknown benchmark: %s\n", name);
+    bench_list();
+}
@@ -0,0 +1,137 @@
+#include "clock.h"
+#include "timer.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "io.h"
+#include <stddef.h>
+
+#define CPUID_EDX_TSC   (1 << 4)
+
+// PIT channel 2 is gated and read back through the keyboard controller's
+// port B; its speaker output is kept off throughout
+#define PIT_CH2_DATA    0x42
+#define PIT_COMMAND     0x43
+#define PORT_B          0x61
+#define PORT_B_GATE2    0x01
+#define PORT_B_SPEAKER  0x02
+#define PORT_B_OUT2     0x20
+
+// Cycles become nanoseconds as (cycles * mult) >> CLOCK_SHIFT; 24 bits keeps
+// mult under 32 bits for any TSC faster than 4MHz
+#define CLOCK_SHIFT     24
+
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0;
+static uint64_t tsc_base = 0;
+
+uint64_t div_u64(uint64_t dividend, uint32_t divisor, uint32_t *remainder) {
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t low = (uint32_t)dividend;
+    uint32_t quot_high = high / divisor;
+    uint32_t rem = high % divisor;
+    uint32_t quot_low;
+    // rem < divisor, so the quotient fits in 32 bits and divl can't fault
+    asm("divl %4" : "=a"(quot_low), "=d"(rem) : "a"(low), "d"(rem), "rm"(divisor));
+    if (remainder) *remainder = rem;
+    return ((uint64_t)quot_high << 32) | quot_low;
+}
+
+// TSC cycles across one CLOCK_CALIBRATE_MS countdown of PIT channel 2 in
+// mode 0, whose output goes high when the count runs out
+static uint64_t time_pit_gate(void) {
+    uint32_t latch = PIT_FREQUENCY / (1000 / CLOCK_CALIBRATE_MS);
+    outb(PORT_B, (inb(PORT_B) & ~(PORT_B_SPEAKER | PORT_B_GATE2)));
+    outb(PIT_COMMAND, 0xB0); // Channel 2, low then high byte, mode 0
+    outb(PIT_CH2_DATA, latch & 0xFF);
+    outb(PIT_CH2_DATA, (latch >> 8) & 0xFF);
+
+    // Raising the gate starts the count
+    uint64_t start = rdtsc();
+    outb(PORT_B, (inb(PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+    while (!(inb(PORT_B) & PORT_B_OUT2)) {
+        asm volatile("pause");
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    outb(PORT_B, inb(PORT_B) & ~PORT_B_GATE2);
+    return cycles;
+}
+
+// Runs with interrupts off, before anything reads the clock
+void clock_init(void) {
+    if (!cpu_has_edx_feature(CPUID_EDX_TSC)) {
+        printf("clock: no TSC, using the %uHz tick\n", TIMER_HZ);
+        return;
+    }
+
+    uint64_t best = ~0ULL;
+    for (uint32_t i = 0; i < CLOCK_CALIBRATE_RUNS; i++) {
+        uint64_t cycles = time_pit_gate();
+        if (cycles < best) best = cycles;
+    }
+    uint64_t khz = div_u64(best, CLOCK_CALIBRATE_MS, NULL);
+    if (khz == 0 || khz > 0xFFFFFFFF) {
+        printf("clock: TSC calibration failed, using the %uHz tick\n", TIMER_HZ);
+        return;
+    }
+
+    tsc_khz = (uint32_t)khz;
+    tsc_mult = (uint32_t)div_u64((uint64_t)NSEC_PER_MSEC << CLOCK_SHIFT, tsc_khz, NULL);
+    // Line the TSC clock up with the ticks that have already passed
+    tsc_base = rdtsc() - (uint64_t)get_tick_count() * (1000 / TIMER_HZ) * tsc_khz;
+    printf("clock: TSC at %u kHz\n", tsc_khz);
+}
+
+bool clock_has_tsc(void) {
+    return tsc_khz != 0;
+}
+
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
+
+// Split so neither product overflows: the high half's contribution has
+// already been shifted up by 32
+uint64_t cycles_to_ns(uint64_t cycles) {
+    uint64_t high = (cycles >> 32) * tsc_mult;
+    uint64_t low = (uint64_t)(uint32_t)cycles * tsc_mult;
+    return (high << (32 - CLOCK_SHIFT)) + (low >> CLOCK_SHIFT);
+}
+
+uint64_t clock_ns(void) {
+    if (!tsc_khz) {
+        return (uint64_t)get_tick_count() * (NSEC_PER_SEC / TIMER_HZ);
+    }
+    return cycles_to_ns(rdtsc() - tsc_base);
+}
+
+static void delay_ns(uint64_t nanoseconds) {
+    uint64_t deadline = clock_ns() + nanoseconds;
+    while (clock_ns() < deadline) {
+        asm volatile("pause");
+    }
+}
+
+void ndelay(uint32_t nanoseconds) {
+    delay_ns(nanoseconds);
+}
+
+void udelay(uint32_t microseconds) {
+    delay_ns((uint64_t)microseconds * NSEC_PER_USEC);
+}
+
+void clock_report(void) {
+    uint32_t ms;
+    uint64_t ns = clock_ns();
+    uint32_t seconds = (uint32_t)div_u64(ns, NSEC_PER_SEC, NULL);
+    div_u64(ns, NSEC_PER_SEC, &ms);
+    ms /= NSEC_PER_MSEC;
+
+    printf("up %u.%u%u%u s, %u ticks\n", seconds, ms / 100, ms / 10 % 10, ms % 10,
+           get_tick_count());
+    if (tsc_khz) {
+        printf("clock source: TSC at %u kHz\n", tsc_khz);
+    } else {
+        printf("clock source: %uHz timer tick\n", TIMER_HZ);
+    }
+}
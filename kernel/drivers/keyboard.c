@@ -1,11 +1,32 @@
 #include "drivers/keyboard.h"
 #include "io.h"
-#include "pic.h"
 #include "kernel.h"
+#include "wait.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "softirq.h"
+#include "workqueue.h"
 
 // Global keyboard state
 keyboard_state_t keyboard_state;
 
+// Readers blocked until a key arrives
+static wait_queue_t keyboard_wait = WAIT_QUEUE_INIT;
+
+// Guards the key buffer, filled by the bottom half on the boot CPU and
+// drained by readers on any
+static spinlock_t keyboard_lock = SPINLOCK_INIT;
+
+// Raw scancodes from the interrupt handler, waiting for the bottom half.
+// Both ends run on the boot CPU and each index has a single writer.
+#define SCANCODE_RING_SIZE 64
+static volatile uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
+
+// Setting the LEDs waits on the controller, so it's done by a worker
+static work_t led_work;
+
 // Scancode to ASCII conversion table (US QWERTY)
 static char scancode_table[128] = {
     0,   27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -32,6 +53,11 @@ static char scancode_table_shift[128] = {
     0, 0, 0, 0, 0, 0, 0, 0
 };
 
+static void keyboard_led_work(work_t *work) {
+    (void)work;
+    keyboard_update_leds();
+}
+
 void keyboard_init(void) {
     // Initialize keyboard state
     keyboard_state.flags = 0;
@@ -46,6 +72,9 @@ void keyboard_init(void) {
         keyboard_state.buffer[i] = 0;
     }
     
+    work_init(&led_work, keyboard_led_work, NULL);
+    open_softirq(SOFTIRQ_KEYBOARD, keyboard_handler);
+    
     print_message("Keyboard driver initialized\n");
 }
 
@@ -80,21 +109,25 @@ bool keyboard_data_available(void) {
 }
 
 void keyboard_buffer_put(uint8_t scancode) {
+    uint32_t irq = spin_lock_irqsave(&keyboard_lock);
     if (keyboard_state.buffer_count < KEYBOARD_BUFFER_SIZE) {
         keyboard_state.buffer[keyboard_state.buffer_head] = scancode;
         keyboard_state.buffer_head = (keyboard_state.buffer_head + 1) % KEYBOARD_BUFFER_SIZE;
         keyboard_state.buffer_count++;
     }
+    spin_unlock_irqrestore(&keyboard_lock, irq);
 }
 
 uint8_t keyboard_buffer_get(void) {
+    uint8_t scancode = 0;
+    uint32_t irq = spin_lock_irqsave(&keyboard_lock);
     if (keyboard_state.buffer_count > 0) {
-        uint8_t scancode = keyboard_state.buffer[keyboard_state.buffer_tail];
+        scancode = keyboard_state.buffer[keyboard_state.buffer_tail];
         keyboard_state.buffer_tail = (keyboard_state.buffer_tail + 1) % KEYBOARD_BUFFER_SIZE;
         keyboard_state.buffer_count--;
-        return scancode;
     }
-    return 0;
+    spin_unlock_irqrestore(&keyboard_lock, irq);
+    return scancode;
 }
 
 bool keyboard_buffer_empty(void) {
@@ -115,9 +148,7 @@ char scancode_to_ascii(uint8_t scancode, bool shift) {
     }
 }
 
-void keyboard_handler(void) {
-    uint8_t scancode = keyboard_read_data();
-    
+static void keyboard_process_scancode(uint8_t scancode) {
     // Handle extended scancodes (0xE0 prefix)
     if (scancode == 0xE0) {
         keyboard_state.extended_scancode = true;
@@ -158,21 +189,21 @@ void keyboard_handler(void) {
         case KEY_CAPS_LOCK:
             if (!key_released) {
                 keyboard_state.flags ^= KEYBOARD_FLAG_CAPS_LOCK;
-                keyboard_update_leds();
+                queue_work(&led_work);
             }
             break;
             
         case KEY_NUM_LOCK:
             if (!key_released) {
                 keyboard_state.flags ^= KEYBOARD_FLAG_NUM_LOCK;
-                keyboard_update_leds();
+                queue_work(&led_work);
             }
             break;
             
         case KEY_SCROLL_LOCK:
             if (!key_released) {
                 keyboard_state.flags ^= KEYBOARD_FLAG_SCROLL_LOCK;
-                keyboard_update_leds();
+                queue_work(&led_work);
             }
             break;
             
@@ -187,6 +218,19 @@ void keyboard_handler(void) {
     keyboard_state.extended_scancode = false;
 }
 
+// Bottom half: decode everything the interrupt handler queued, then wake
+// readers once for the lot
+void keyboard_handler(void) {
+    while (scancode_tail != scancode_head) {
+        uint8_t scancode = scancode_ring[scancode_tail % SCANCODE_RING_SIZE];
+        scancode_tail++;
+        keyboard_process_scancode(scancode);
+    }
+    if (keyboard_data_available()) {
+        wake_up(&keyboard_wait);
+    }
+}
+
 char keyboard_get_char(void) {
     if (keyboard_buffer_empty()) {
         return 0;
@@ -207,6 +251,16 @@ char keyboard_get_char(void) {
     return c;
 }
 
+// Block until a key that produces a character is pressed
+char keyboard_read_char(void) {
+    char c;
+    do {
+        wait_event(&keyboard_wait, keyboard_data_available());
+        c = keyboard_get_char();
+    } while (c == 0);
+    return c;
+}
+
 void keyboard_set_leds(uint8_t leds) {
     keyboard_write_data(KEYBOARD_CMD_SET_LEDS);
     keyboard_write_data(leds);
@@ -230,8 +284,14 @@ void keyboard_disable(void) {
     keyboard_write_data(KEYBOARD_CMD_DISABLE);
 }
 
-// Interrupt handler called from assembly
+// Interrupt handler called from assembly: take the byte off the
+// controller and leave the rest to the bottom half. The common stub sends
+// the EOI.
 void keyboard_interrupt_handler(void) {
-    keyboard_handler();
-    pic_send_eoi(IRQ_KEYBOARD);
+    uint8_t scancode = keyboard_read_data();
+    if (scancode_head - scancode_tail < SCANCODE_RING_SIZE) {
+        scancode_ring[scancode_head % SCANCODE_RING_SIZE] = scancode;
+        scancode_head++;
+    }
+    raise_softirq(SOFTIRQ_KEYBOARD);
 }
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "sched.h"
+#include "memory/slab.h"
+#include <string.h>
+
+static kmem_cache_t *fpu_cache = NULL;
+
+// Each CPU's fpu_owner is the task whose state is live in its registers
+
+static bool has_fxsr = false;
+static bool has_sse2 = false;
+
+static inline void clts(void) {
+    asm volatile("clts");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(fpu_state_t *state) {
+    if (has_fxsr) {
+        asm volatile("fxsave (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile("fnsave (%0); fwait" : : "r"(state) : "memory");
+    }
+}
+
+static void fpu_restore(const fpu_state_t *state) {
+    if (has_fxsr) {
+        asm volatile("fxrstor (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile("frstor (%0)" : : "r"(state) : "memory");
+    }
+}
+
+// Set up this CPU's FPU; the first call, on the boot CPU, also probes
+// the features and creates the state cache
+void fpu_init(void) {
+    has_fxsr = cpu_has_edx_feature(CPUID_EDX_FXSR);
+    has_sse2 = has_fxsr && cpu_has_edx_feature(CPUID_EDX_SSE) &&
+               cpu_has_edx_feature(CPUID_EDX_SSE2);
+    
+    // Native x87 error reporting, and have WAIT honour TS as well
+    uint32_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+    asm volatile("fninit");
+    
+    if (has_fxsr) {
+        uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+        if (has_sse2) cr4 |= CR4_OSXMMEXCPT;
+        write_cr4(cr4);
+    }
+    
+    // Nobody owns the registers yet, so the first use traps
+    stts();
+    if (fpu_cache) return;
+    
+    fpu_cache = kmem_cache_create("fpu_state", sizeof(fpu_state_t), 16, 0, NULL);
+    printf("FPU: %s save, SSE2 %s\n", has_fxsr ? "FXSAVE" : "FNSAVE",
+           has_sse2 ? "available" : "unavailable");
+}
+
+// #NM: hand the registers to the current task, saving the previous owner's
+// state and loading (or creating) the current task's
+bool fpu_handle_trap(void) {
+    clts();
+    cpu_t *cpu = this_cpu();
+    process_t *proc = cpu->current;
+    if (cpu->fpu_owner == proc) return true;
+    
+    if (cpu->fpu_owner) {
+        fpu_save(cpu->fpu_owner->fpu_state);
+    }
+    cpu->fpu_owner = NULL;
+    
+    if (!proc) {
+        asm volatile("fninit");
+        return true;
+    }
+    
+    if (proc->fpu_state) {
+        fpu_restore(proc->fpu_state);
+    } else {
+        proc->fpu_state = (fpu_state_t*)kmem_cache_alloc(fpu_cache);
+        if (!proc->fpu_state) {
+            printf("ERROR: Out of memory for FPU state\n");
+            return false;
+        }
+        asm volatile("fninit");
+    }
+    cpu->fpu_owner = proc;
+    return true;
+}
+
+// With more than one CPU the outgoing task may resume elsewhere, where
+// registers left behind here can't follow it, so its state is saved as it
+// leaves instead of when the next task wants the FPU
+void fpu_switch(process_t *prev, process_t *next) {
+    cpu_t *cpu = this_cpu();
+    if (cpu_count > 1 && cpu->fpu_owner == prev) {
+        clts();
+        fpu_save(prev->fpu_state);
+        cpu->fpu_owner = NULL;
+    }
+    
+    if (next == cpu->fpu_owner) {
+        clts();
+    } else {
+        stts();
+    }
+}
+
+// Give the child a copy of the parent's FPU state, if it has any
+bool fpu_fork(process_t *parent, process_t *child) {
+    if (!parent->fpu_state) return true;
+    
+    child->fpu_state = (fpu_state_t*)kmem_cache_alloc(fpu_cache);
+    if (!child->fpu_state) return false;
+    
+    if (this_cpu()->fpu_owner == parent) {
+        uint32_t cr0 = read_cr0();
+        clts();
+        fpu_save(parent->fpu_state);
+        // FNSAVE reinitialises the FPU, so reload what the parent had
+        if (!has_fxsr) fpu_restore(parent->fpu_state);
+        write_cr0(cr0);
+    }
+    memcpy(child->fpu_state, parent->fpu_state, sizeof(fpu_state_t));
+    return true;
+}
+
+void fpu_release(process_t *proc) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].fpu_owner == proc) {
+            cpus[i].fpu_owner = NULL;
+        }
+    }
+    if (proc->fpu_state) {
+        kmem_cache_free(fpu_cache, proc->fpu_state);
+        proc->fpu_state = NULL;
+    }
+}
+
+void kernel_fpu_begin(void) {
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    cpu->kernel_fpu_flags = flags;
+    clts();
+    
+    // Park the owner's registers; it reloads them through #NM when it next
+    // uses the FPU
+    if (cpu->fpu_owner) {
+        fpu_save(cpu->fpu_owner->fpu_state);
+        cpu->fpu_owner = NULL;
+    }
+}
+
+void kernel_fpu_end(void) {
+    stts();
+    irq_restore(this_cpu()->kernel_fpu_flags);
+}
+
+bool sse2_available(void) {
+    return has_sse2;
+}
+
+#define SSE_BLOCK 64 // Four XMM registers per loop iteration
+
+__attribute__((target("sse2")))
+void sse_memcpy(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t*)dest;
+    const uint8_t *s = (const uint8_t*)src;
+    
+    // Align the destination so the stores can be movdqa
+    size_t head = -(uint32_t)d & 15;
+    if (head > n) head = n;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    
+    for (; n >= SSE_BLOCK; n -= SSE_BLOCK, d += SSE_BLOCK, s += SSE_BLOCK) {
+        asm volatile("movdqu 0(%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movdqa %%xmm0, 0(%0)\n\t"
+                     "movdqa %%xmm1, 16(%0)\n\t"
+                     "movdqa %%xmm2, 32(%0)\n\t"
+                     "movdqa %%xmm3, 48(%0)"
+                     : : "r"(d), "r"(s)
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("sse2")))
+void sse_memset(void *dest, int c, size_t n) {
+    uint8_t *d = (uint8_t*)dest;
+    
+    size_t head = -(uint32_t)d & 15;
+    if (head > n) head = n;
+    memset(d, c, head);
+    d += head;
+    n -= head;
+    
+    // Broadcast the byte into xmm0 and store it 64 bytes at a time
+    uint32_t value = (uint8_t)c * 0x01010101;
+    size_t blocks = n / SSE_BLOCK;
+    n -= blocks * SSE_BLOCK;
+    if (blocks) {
+        asm volatile("movd %2, %%xmm0\n\t"
+                     "pshufd $0, %%xmm0, %%xmm0\n"
+                     "1:\n\t"
+                     "movdqa %%xmm0, 0(%0)\n\t"
+                     "movdqa %%xmm0, 16(%0)\n\t"
+                     "movdqa %%xmm0, 32(%0)\n\t"
+                     "movdqa %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "dec %1\n\t"
+                     "jnz 1b"
+                     : "+r"(d), "+r"(blocks)
+                     : "r"(value)
+                     : "memory", "cc", "xmm0");
+    }
+    memset(d, c, n);
+}
+
+// Non-temporal stores: a page zeroed now is rarely read again soon, so
+// don't let it push useful lines out of the cache
+__attribute__((target("sse2")))
+void sse_zero_page(void *page) {
+    uint8_t *d = (uint8_t*)page;
+    uint32_t blocks = 4096 / SSE_BLOCK;
+    asm volatile("pxor %%xmm0, %%xmm0\n"
+                 "1:\n\t"
+                 "movntdq %%xmm0, 0(%0)\n\t"
+                 "movntdq %%xmm0, 16(%0)\n\t"
+                 "movntdq %%xmm0, 32(%0)\n\t"
+                 "movntdq %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b\n\t"
+                 "sfence"
+                 : "+r"(d), "+r"(blocks)
+                 :
+                 : "memory", "cc", "xmm0");
+}
@@ -1,5 +1,8 @@
 #include "interrupts/idt.h"
 #include "kernel.h"
+#include "memory/paging.h"
+#include "process.h"
+#include "fpu.h"
 #include <string.h>
 
 idt_entry_t idt[IDT_ENTRIES];
@@ -25,10 +28,12 @@ void idt_init(void) {
     
     // Set up exception handlers (0-31) 
     extern void divide_error_handler_asm(void);
+    extern void device_not_available_handler_asm(void);
     extern void general_protection_fault_handler_asm(void);
     extern void page_fault_handler_asm(void);
     
     idt_set_gate(0, (uint32_t)divide_error_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
+    idt_set_gate(7, (uint32_t)device_not_available_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
     idt_set_gate(13, (uint32_t)general_protection_fault_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
     idt_set_gate(14, (uint32_t)page_fault_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
     
@@ -72,6 +77,17 @@ void breakpoint_handler(void) {
     asm volatile("cli; hlt");
 }
 
+void device_not_available_handler(void) {
+    // Lazy FPU switching: the running task wants the FPU registers
+    if (fpu_handle_trap()) {
+        return;
+    }
+    
+    print_message("EXCEPTION: Device not available\n");
+    print_message("System halted.\n");
+    asm volatile("cli; hlt");
+}
+
 void general_protection_fault_handler(void) {
     print_message("EXCEPTION: General Protection Fault\n");
     print_message("This usually indicates a segmentation violation.\n");
@@ -79,10 +95,16 @@ void general_protection_fault_handler(void) {
     asm volatile("cli; hlt");
 }
 
-void page_fault_handler(void) {
+void page_fault_handler(interrupt_frame_t *frame) {
     uint32_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
     
+    // Copy-on-write and demand-zero faults resume the faulting code
+    if (paging_handle_fault(faulting_address, frame->err_code) ||
+        process_handle_fault(faulting_address, frame->err_code)) {
+        return;
+    }
+    
     print_message("EXCEPTION: Page Fault\n");
     print_message("Faulting address: 0x");
     
@@ -7,6 +7,13 @@ extern keyboard_interrupt_handler
 extern divide_error_handler
 extern general_protection_fault_handler
 extern page_fault_handler
+extern device_not_available_handler
+extern sched_irq_return
+extern irq_enter
+extern timer_irq_enter
+extern lapic_timer_handler
+extern tlb_shootdown_handler
+extern lapic_eoi
 
 ; Export assembly handlers
 global divide_error_handler_asm
@@ -15,8 +22,13 @@ global nmi_handler_asm
 global breakpoint_handler_asm
 global general_protection_fault_handler_asm
 global page_fault_handler_asm
+global device_not_available_handler_asm
 global timer_handler_asm
 global keyboard_handler_asm
+global lapic_timer_handler_asm
+global reschedule_handler_asm
+global tlb_shootdown_handler_asm
+global spurious_handler_asm
 
 section .text
 
@@ -51,6 +63,7 @@ ISR_NOERRCODE divide_error_handler_asm, 0
 ISR_NOERRCODE debug_handler_asm, 1
 ISR_NOERRCODE nmi_handler_asm, 2
 ISR_NOERRCODE breakpoint_handler_asm, 3
+ISR_NOERRCODE device_not_available_handler_asm, 7
 ISR_ERRCODE general_protection_fault_handler_asm, 13
 ISR_ERRCODE page_fault_handler_asm, 14
 
@@ -58,9 +71,16 @@ ISR_ERRCODE page_fault_handler_asm, 14
 IRQ timer_handler_asm, 32
 IRQ keyboard_handler_asm, 33
 
+; Local APIC vectors; %fs keeps pointing at this CPU's data throughout
+IRQ lapic_timer_handler_asm, 48
+IRQ reschedule_handler_asm, 49
+IRQ tlb_shootdown_handler_asm, 50
+IRQ spurious_handler_asm, 63
+
 ; Common exception handler stub
 isr_common_stub:
     pusha              ; Push all general purpose registers
+    cld                ; C code expects DF clear; iret restores the caller's
     
     mov ax, ds         ; Save data segment
     push eax
@@ -68,7 +88,6 @@ isr_common_stub:
     mov ax, 0x10       ; Load kernel data segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
     mov gs, ax
     
     ; Get interrupt number from stack
@@ -77,6 +96,8 @@ isr_common_stub:
     ; Call appropriate C handler based on interrupt number
     cmp eax, 0
     je .divide_error
+    cmp eax, 7
+    je .device_not_available
     cmp eax, 13
     je .gpf
     cmp eax, 14
@@ -90,19 +111,24 @@ isr_common_stub:
     call divide_error_handler
     jmp .end
     
+.device_not_available:
+    call device_not_available_handler
+    jmp .end
+    
 .gpf:
     call general_protection_fault_handler
     jmp .end
     
 .page_fault:
+    push esp           ; interrupt_frame_t * for the C handler
     call page_fault_handler
+    add esp, 4
     jmp .end
     
 .end:
     pop eax            ; Restore data segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
     mov gs, ax
     
     popa               ; Restore registers
@@ -113,6 +139,7 @@ isr_common_stub:
 ; Common IRQ handler stub
 irq_common_stub:
     pusha              ; Push all general purpose registers
+    cld                ; C code expects DF clear; iret restores the caller's
     
     mov ax, ds         ; Save data segment
     push eax
@@ -120,9 +147,15 @@ irq_common_stub:
     mov ax, 0x10       ; Load kernel data segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
     mov gs, ax
     
+    ; Time the top half, then restart the periodic tick if this
+    ; interrupt ended a tickless halt
+    push esp           ; interrupt_frame_t *, to see where it came from
+    call irq_enter
+    add esp, 4
+    call timer_irq_enter
+    
     ; Get interrupt number from stack
     mov eax, [esp + 36] ; Get interrupt number (after pusha + segment)
     
@@ -130,6 +163,14 @@ irq_common_stub:
     je .timer
     cmp eax, 33        ; Keyboard interrupt?
     je .keyboard
+    cmp eax, 48
+    je .lapic_timer
+    cmp eax, 49        ; Reschedule: sched_irq_return does the work
+    je .end
+    cmp eax, 50
+    je .tlb_shootdown
+    cmp eax, 63        ; Spurious: no EOI, nothing to reschedule
+    je .spurious
     jmp .end
     
 .timer:
@@ -140,15 +181,37 @@ irq_common_stub:
     call keyboard_interrupt_handler
     jmp .end
     
+.lapic_timer:
+    call lapic_timer_handler
+    jmp .end
+    
+.tlb_shootdown:
+    call tlb_shootdown_handler
+    jmp .end
+    
 .end:
+    mov eax, [esp + 36]
+    cmp eax, 48        ; Local APIC vector?
+    jae .lapic_eoi
+    
     ; Send EOI to PIC
     mov al, 0x20
     out 0x20, al       ; Send EOI to master PIC
+    jmp .resched
+    
+.lapic_eoi:
+    call lapic_eoi
+    
+.resched:
+    ; Run the bottom halves, wake anything the interrupt made runnable and
+    ; switch tasks if it's due; we come back here when this task is next
+    ; scheduled
+    call sched_irq_return
     
+.spurious:
     pop eax            ; Restore data segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
     mov gs, ax
     
     popa               ; Restore registers
@@ -1,9 +1,17 @@
 #include "kernel.h"
 #include "interrupts/idt.h"
 #include "memory/paging.h"
+#include "memory/zero_pool.h"
 #include "timer.h"
+#include "clock.h"
 #include "syscall.h"
 #include "process.h"
+#include "sched.h"
+#include "smp.h"
+#include "softirq.h"
+#include "workqueue.h"
+#include "fpu.h"
+#include "cpu.h"
 #include "io.h"
 #include "pic.h"
 #include "fs/fs.h"
@@ -115,10 +123,38 @@ void putchar(char c) {
     }
 }
 
-void kernel_init() {
+// Wait for something to happen. Tasks block until the next interrupt; the
+// idle task spends the time on background work, halting once there's none.
+void kernel_idle(void) {
+    if (current_process && current_process != idle_process) {
+        sched_wait_interrupt();
+    } else if (softirq_pending()) {
+        // Bottom halves left over from a busy interrupt return
+        uint32_t irq = irq_save();
+        do_softirq();
+        irq_restore(irq);
+    } else if (this_cpu()->need_resched) {
+        schedule();
+    } else if (!zero_pool_idle()) {
+        // sti only takes effect after hlt, so nothing can slip in between
+        // the last check and the halt
+        uint32_t irq = irq_save();
+        if (!this_cpu()->need_resched && !softirq_pending()) {
+            timer_idle_enter();
+            asm volatile("sti; hlt; cli" : : : "memory");
+        }
+        irq_restore(irq);
+    }
+}
+
+void kernel_init(const e820_map_t *memory_map) {
     print_message("Kyro OS - Initializing core systems...\n");
     
-    // Initialize core systems first
+    // Initialize core systems first; per-CPU data comes before anything
+    // that looks at the current process
+    print_message("Setting up per-CPU data...\n");
+    percpu_init();
+    
     print_message("Setting up IDT...\n");
     idt_init();
     
@@ -126,10 +162,13 @@ void kernel_init() {
     pic_init();
     
     print_message("Setting up timer...\n");
-    timer_init(100);   // 100Hz timer
+    timer_init(TIMER_HZ);
+    
+    print_message("Calibrating clock...\n");
+    clock_init();
     
     print_message("Setting up memory management...\n");
-    paging_init();
+    paging_init(memory_map);
     
     print_message("Setting up system calls...\n");
     syscall_init();
@@ -137,6 +176,15 @@ void kernel_init() {
     print_message("Setting up process management...\n");
     process_init();
     
+    print_message("Setting up FPU...\n");
+    fpu_init();
+    
+    print_message("Starting other CPUs...\n");
+    smp_init();
+    
+    print_message("Starting worker threads...\n");
+    workqueue_init();
+    
     // Enable interrupts for timer and keyboard
     print_message("Enabling hardware interrupts...\n");
     pic_enable_irq(0); // Timer
@@ -165,13 +213,13 @@ void kernel_init() {
     print_message("Kyro OS - All systems initialized successfully!\n");
 }
 
-void kernel_main() { 
+void kernel_main(const e820_map_t *memory_map) { 
     print_message("Welcome to Kyro OS!\n");
     print_message("You're in control!\n\n");
     
     // Initialize all kernel systems
     print_message("About to init kernel...\n");
-    kernel_init();
+    kernel_init(memory_map);
     print_message("Kernel init complete\n");
     
     // Enable interrupts
@@ -189,6 +237,6 @@ void kernel_main() {
     // Enter idle loop
     print_message("Entering system idle loop...\n");
     while (1) {
-        asm volatile("hlt"); // Halt until next interrupt
+        kernel_idle();
     }
 }
\ No newline at end of file
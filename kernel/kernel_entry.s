@@ -27,7 +27,8 @@ _start:
     mov esi, boot_success_msg
     call print_early
     
-    ; Call C kernel main function
+    ; Call C kernel main function with the bootloader's E820 map (EBX)
+    push ebx
     call kernel_main
     
     ; Hang if kernel returns
@@ -0,0 +1,175 @@
+#include "ktimer.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "sched.h"
+#include <stddef.h>
+
+typedef struct {
+    uint32_t clock; // Next tick to process
+    ktimer_t *tv1[TVR_SIZE];
+    ktimer_t *tvn[TVN_LEVELS][TVN_SIZE];
+} timer_wheel_t;
+
+static timer_wheel_t wheel;
+ktimer_stats_t ktimer_stats;
+
+// Guards the wheel; dropped while a callback runs, so callbacks may arm
+// timers of their own
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+static ktimer_t *volatile running_timer = NULL;
+
+// Tick the boot CPU's stopped PIT will wake it at, while it halts
+static bool idle_armed = false;
+static uint32_t idle_deadline = 0;
+
+void ktimer_init(ktimer_t *timer, void (*callback)(ktimer_t *timer), void *data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+static void slot_insert(ktimer_t **slot, ktimer_t *timer) {
+    timer->next = *slot;
+    if (*slot) (*slot)->pprev = &timer->next;
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void slot_remove(ktimer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// The slot for a timer depends only on how far off it is from the wheel's
+// clock: level n holds timers due within 2^(8 + 6n) ticks
+static void wheel_insert(ktimer_t *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel.clock;
+    ktimer_t **slot;
+
+    if ((int32_t)delta < 0) {
+        slot = &wheel.tv1[wheel.clock & TVR_MASK];
+    } else if (delta < TVR_SIZE) {
+        slot = &wheel.tv1[expires & TVR_MASK];
+    } else {
+        uint32_t level = 0;
+        while (level < TVN_LEVELS - 1 &&
+               delta >= (1u << (TVR_BITS + (level + 1) * TVN_BITS))) {
+            level++;
+        }
+        uint32_t shift = TVR_BITS + level * TVN_BITS;
+        slot = &wheel.tvn[level][(expires >> shift) & TVN_MASK];
+    }
+    slot_insert(slot, timer);
+}
+
+void ktimer_add(ktimer_t *timer, uint32_t expires) {
+    uint32_t irq = spin_lock_irqsave(&wheel_lock);
+    if (ktimer_pending(timer)) {
+        slot_remove(timer);
+    } else {
+        ktimer_stats.pending++;
+    }
+    timer->expires = expires;
+    wheel_insert(timer);
+
+    // Only the boot CPU runs the wheel, so one halted past the new expiry
+    // has to be woken to put its tick back
+    bool kick = idle_armed && (int32_t)(expires - idle_deadline) < 0;
+    if (kick) idle_armed = false;
+    spin_unlock_irqrestore(&wheel_lock, irq);
+
+    if (kick && smp_processor_id() != 0) smp_send_reschedule(0);
+}
+
+bool ktimer_cancel(ktimer_t *timer) {
+    uint32_t irq = spin_lock_irqsave(&wheel_lock);
+    bool pending = ktimer_pending(timer);
+    if (pending) {
+        slot_remove(timer);
+        ktimer_stats.pending--;
+    }
+    spin_unlock_irqrestore(&wheel_lock, irq);
+    
+    while (running_timer == timer) {
+        cpu_relax();
+    }
+    return pending;
+}
+
+// Spread one slot of a level over the levels below it
+static uint32_t cascade(uint32_t level, uint32_t index) {
+    ktimer_t *timer = wheel.tvn[level][index];
+    wheel.tvn[level][index] = NULL;
+    while (timer) {
+        ktimer_t *next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        wheel_insert(timer);
+        ktimer_stats.cascaded++;
+        timer = next;
+    }
+    return index;
+}
+
+static inline uint32_t level_index(uint32_t level) {
+    return (wheel.clock >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+}
+
+void ktimer_run(uint32_t now) {
+    uint32_t irq = spin_lock_irqsave(&wheel_lock);
+    while ((int32_t)(now - wheel.clock) >= 0) {
+        uint32_t index = wheel.clock & TVR_MASK;
+
+        // Each level wraps into the next when its own index comes round to 0
+        if (index == 0) {
+            for (uint32_t level = 0; level < TVN_LEVELS; level++) {
+                if (cascade(level, level_index(level)) != 0) break;
+            }
+        }
+        wheel.clock++;
+
+        ktimer_t *timer;
+        while ((timer = wheel.tv1[index]) != NULL) {
+            slot_remove(timer);
+            ktimer_stats.pending--;
+            ktimer_stats.fired++;
+            running_timer = timer;
+            spin_unlock_irqrestore(&wheel_lock, irq);
+            timer->callback(timer);
+            irq = spin_lock_irqsave(&wheel_lock);
+            running_timer = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&wheel_lock, irq);
+}
+
+static uint32_t idle_ticks(uint32_t now, uint32_t limit) {
+    if (ktimer_stats.pending == 0) return limit;
+    for (uint32_t tick = wheel.clock; tick - now < limit; tick++) {
+        // A cascade counts as work, since it may bring timers due sooner
+        if (wheel.tv1[tick & TVR_MASK] || (tick & TVR_MASK) == 0) {
+            return tick - now;
+        }
+    }
+    return limit;
+}
+
+uint32_t ktimer_idle_ticks(uint32_t now, uint32_t limit) {
+    uint32_t irq = spin_lock_irqsave(&wheel_lock);
+    uint32_t ticks = idle_ticks(now, limit);
+    idle_armed = true;
+    idle_deadline = now + ticks;
+    spin_unlock_irqrestore(&wheel_lock, irq);
+    return ticks;
+}
+
+void ktimer_idle_exit(void) {
+    uint32_t irq = spin_lock_irqsave(&wheel_lock);
+    idle_armed = false;
+    spin_unlock_irqrestore(&wheel_lock, irq);
+}
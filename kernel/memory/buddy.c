@@ -0,0 +1,190 @@
+#include "memory/buddy.h"
+#include "memory/paging.h"
+#include "kernel.h"
+#include "spinlock.h"
+#include <string.h>
+#include <stddef.h>
+
+// Binary buddy allocator for physical frames. Free blocks of 2^order frames
+// sit on per-order lists; allocation splits the smallest adequate block and
+// freeing merges a block with its buddy (frame ^ 2^order) for as long as the
+// buddy is itself a free block of the same order.
+
+static frame_info_t *frame_info = NULL;
+static uint32_t nframes = 0;
+static uint32_t free_count = 0;
+static uint32_t free_area[BUDDY_MAX_ORDER + 1];
+
+// Guards the free lists and per-frame block state, but not refcounts,
+// which are changed atomically
+static spinlock_t buddy_lock = SPINLOCK_INIT;
+
+static void list_push(uint32_t frame, uint32_t order) {
+    frame_info_t *f = &frame_info[frame];
+    f->order = order;
+    f->flags |= FRAME_FREE;
+    f->prev = BUDDY_NONE;
+    f->next = free_area[order];
+    if (f->next != BUDDY_NONE) frame_info[f->next].prev = frame;
+    free_area[order] = frame;
+}
+
+static void list_remove(uint32_t frame) {
+    frame_info_t *f = &frame_info[frame];
+    if (f->prev != BUDDY_NONE) frame_info[f->prev].next = f->next;
+    else free_area[f->order] = f->next;
+    if (f->next != BUDDY_NONE) frame_info[f->next].prev = f->prev;
+    f->flags &= ~FRAME_FREE;
+}
+
+static inline bool is_free_head(uint32_t frame, uint32_t order) {
+    return frame < nframes &&
+           (frame_info[frame].flags & FRAME_FREE) &&
+           frame_info[frame].order == order;
+}
+
+void buddy_init(uint32_t total_frames, frame_info_t *storage) {
+    nframes = total_frames;
+    frame_info = storage;
+    memset(frame_info, 0, nframes * sizeof(frame_info_t));
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        free_area[i] = BUDDY_NONE;
+    }
+    free_count = 0;
+    // Everything starts out allocated until buddy_free_range says otherwise
+}
+
+static void free_block(uint32_t frame, uint32_t order) {
+    free_count += 1u << order;
+
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (!is_free_head(buddy, order)) break;
+        list_remove(buddy);
+        frame &= ~(1u << order);
+        order++;
+    }
+    list_push(frame, order);
+}
+
+void buddy_free_range(uint32_t start_addr, uint32_t end_addr) {
+    uint32_t frame = (start_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t end = end_addr / PAGE_SIZE;
+    if (end > nframes) end = nframes;
+    if (frame == 0) frame = 1; // Keep frame 0 reserved so 0 can mean failure
+
+    // Release the range as the largest naturally aligned blocks that fit
+    while (frame < end) {
+        uint32_t order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+               !(frame & ((2u << order) - 1)) &&
+               frame + (2u << order) <= end) {
+            order++;
+        }
+        free_block(frame, order);
+        frame += 1u << order;
+    }
+}
+
+uint32_t alloc_pages(uint32_t order) {
+    if (order > BUDDY_MAX_ORDER) return 0;
+
+    uint32_t irq = spin_lock_irqsave(&buddy_lock);
+    uint32_t o = order;
+    while (o <= BUDDY_MAX_ORDER && free_area[o] == BUDDY_NONE) o++;
+    if (o > BUDDY_MAX_ORDER) {
+        spin_unlock_irqrestore(&buddy_lock, irq);
+        return 0;
+    }
+
+    uint32_t frame = free_area[o];
+    list_remove(frame);
+
+    // Hand the upper halves back until the block is the requested size
+    while (o > order) {
+        o--;
+        list_push(frame + (1u << o), o);
+    }
+
+    frame_info[frame].order = order;
+    free_count -= 1u << order;
+    spin_unlock_irqrestore(&buddy_lock, irq);
+    return frame * PAGE_SIZE;
+}
+
+void free_pages(uint32_t addr, uint32_t order) {
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame == 0 || frame >= nframes || order > BUDDY_MAX_ORDER) return;
+
+    uint32_t irq = spin_lock_irqsave(&buddy_lock);
+    if (!(frame_info[frame].flags & FRAME_FREE)) { // Ignore double frees
+        free_block(frame, order);
+    }
+    spin_unlock_irqrestore(&buddy_lock, irq);
+}
+
+// Head of the free block containing `frame`, or BUDDY_NONE if it is in use
+static uint32_t containing_free_block(uint32_t frame, uint32_t *order_out) {
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint32_t head = frame & ~((1u << order) - 1);
+        if (is_free_head(head, order)) {
+            *order_out = order;
+            return head;
+        }
+    }
+    return BUDDY_NONE;
+}
+
+bool buddy_frame_free(uint32_t frame) {
+    uint32_t order;
+    return frame < nframes && containing_free_block(frame, &order) != BUDDY_NONE;
+}
+
+// Take one specific frame out of the free pool, splitting around it
+bool buddy_claim_frame(uint32_t frame) {
+    if (frame >= nframes) return false;
+
+    uint32_t irq = spin_lock_irqsave(&buddy_lock);
+    uint32_t order;
+    uint32_t head = containing_free_block(frame, &order);
+    if (head == BUDDY_NONE) {
+        spin_unlock_irqrestore(&buddy_lock, irq);
+        return false;
+    }
+
+    list_remove(head);
+    while (order > 0) {
+        order--;
+        uint32_t half = 1u << order;
+        if (frame < head + half) {
+            list_push(head + half, order);
+        } else {
+            list_push(head, order);
+            head += half;
+        }
+    }
+
+    frame_info[frame].order = 0;
+    free_count--;
+    spin_unlock_irqrestore(&buddy_lock, irq);
+    return true;
+}
+
+uint32_t buddy_any_free_frame(void) {
+    for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        if (free_area[order] != BUDDY_NONE) return free_area[order];
+    }
+    return BUDDY_NONE;
+}
+
+uint32_t buddy_total_frames(void) {
+    return nframes;
+}
+
+uint32_t buddy_free_frames(void) {
+    return free_count;
+}
+
+frame_info_t *buddy_frame_info(uint32_t frame) {
+    return frame < nframes ? &frame_info[frame] : NULL;
+}
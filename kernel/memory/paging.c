@@ -1,165 +1,682 @@
 #include "memory/paging.h"
+#include "memory/buddy.h"
+#include "memory/zero_pool.h"
 #include "kernel.h"
+#include "cpu.h"
+#include "timer.h"
+#include "smp.h"
 #include <string.h>
 #include <stddef.h>
 
 page_directory_t *kernel_directory = NULL;
-page_directory_t *current_directory = NULL;
 
-uint32_t placement_address = 0x100000; 
+// Early boot allocations are carved from RAM just above the kernel image
+uint32_t placement_address = 0;
+
+uint32_t kernel_heap_end = KERNEL_HEAP_START;
+uint32_t vmalloc_end = VMALLOC_START;
+
+// End of the kernel image and of its .bss, from kernel.ld
+extern uint32_t kernel_end;
+extern uint32_t ebss;
 
 // Physical memory allocator
-static uint32_t *frames = NULL;
 static uint32_t nframes = 0;
 
+cow_stats_t cow_stats;
+tlb_stats_t tlb_stats;
+
+// Frames holding paging structures
+static uint32_t directories_in_use = 0;
+static uint32_t tables_in_use = 0;
+
+// Set when kernel mappings are marked global
+static bool global_pages = false;
+
+// The self-map only exists once CR3 holds a directory and paging is on
+static bool paging_active = false;
+
+// Ranges longer than this are cheaper to drop with a full flush
+#define TLB_FLUSH_RANGE_MAX 32
+
+
 // Forward declarations for missing functions
 void set_frame(uint32_t frame_addr);
 void clear_frame(uint32_t frame_addr);
 uint32_t test_frame(uint32_t frame_addr);
 uint32_t first_free_frame(void);
 
+static inline bool is_user_pde(uint32_t index) {
+    return index >= (USER_SPACE_START >> 22) && index < (USER_SPACE_END >> 22);
+}
+
+// Page tables are allocated from the direct map, so a directory entry's
+// address can be dereferenced as is
+static inline page_table_t *pde_table(uint32_t entry) {
+    return (page_table_t*)(entry & 0xFFFFF000);
+}
+
+// Through the self-map, the current directory sits at PAGE_DIR_VADDR and its
+// table for any address at PAGE_TABLES_VADDR
+static inline uint32_t *current_pde(uint32_t virtual_addr) {
+    return (uint32_t*)PAGE_DIR_VADDR + (virtual_addr >> 22);
+}
+
+static inline uint32_t *current_pte(uint32_t virtual_addr) {
+    return (uint32_t*)PAGE_TABLES_VADDR + (virtual_addr >> 12);
+}
+
+// Reloading CR3 drops every translation except global kernel ones
+static inline void flush_tlb(void) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    tlb_stats.full_flushes++;
+}
+
 page_directory_t *create_page_directory(void) {
-    uint32_t phys_addr;
-    page_directory_t *dir = (page_directory_t*)kmalloc_ap(sizeof(page_directory_t), &phys_addr);
-    memset(dir, 0, sizeof(page_directory_t));
-    dir->physical_addr = phys_addr;
+    page_directory_t *dir = (page_directory_t*)alloc_page(ALLOC_ZEROED);
+    if (!dir) return NULL;
+    directories_in_use++;
+
+    // Every address space shares the kernel's tables outside user space
+    if (kernel_directory) {
+        for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+            if (is_user_pde(i) || i == RECURSIVE_PDE) continue;
+            dir->entries[i] = kernel_directory->entries[i];
+        }
+    }
+    dir->entries[RECURSIVE_PDE] = page_directory_phys(dir) | PAGE_PRESENT | PAGE_WRITABLE;
+    return dir;
+}
+
+void destroy_page_directory(page_directory_t *dir) {
+    if (!dir || dir == kernel_directory) return;
+
+    // Drop this address space's references to user frames, then free the
+    // tables and the directory; the idle loop zeroes them again later
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        uint32_t entry = dir->entries[i];
+        if (!(entry & PAGE_PRESENT) || (entry & PAGE_LARGE) || i == RECURSIVE_PDE) continue;
+        page_table_t *table = pde_table(entry);
+        if (!is_user_pde(i)) {
+            // Kernel tables are shared unless this directory split its own
+            if (table == pde_table(kernel_directory->entries[i])) continue;
+        } else {
+            for (uint32_t j = 0; j < PAGE_ENTRIES; j++) {
+                if (table->pages[j] & PAGE_PRESENT) {
+                    frame_put(table->pages[j] & 0xFFFFF000);
+                }
+            }
+        }
+        free_pages((uint32_t)table, 0);
+        tables_in_use--;
+    }
+    free_pages((uint32_t)dir, 0);
+    directories_in_use--;
+}
+
+// Copy-on-write clone of an address space: user frames are shared read-only
+// between both directories and copied by the fault handler on first write
+page_directory_t *clone_directory(page_directory_t *src) {
+    page_directory_t *dir = create_page_directory();
+    if (!dir) return NULL;
+
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        if (!is_user_pde(i) || !(src->entries[i] & PAGE_PRESENT)) continue;
+
+        page_table_t *table = (page_table_t*)alloc_page(ALLOC_ZEROED);
+        if (!table) {
+            destroy_page_directory(dir);
+            return NULL;
+        }
+        tables_in_use++;
+        dir->entries[i] = (uint32_t)table | (src->entries[i] & 0xFFF);
+
+        page_table_t *parent = pde_table(src->entries[i]);
+        for (uint32_t j = 0; j < PAGE_ENTRIES; j++) {
+            uint32_t entry = parent->pages[j];
+            if (!(entry & PAGE_PRESENT)) continue;
+
+            if (entry & (PAGE_WRITABLE | PAGE_COW)) {
+                entry = (entry & ~PAGE_WRITABLE) | PAGE_COW;
+                parent->pages[j] = entry;
+            }
+            table->pages[j] = entry;
+            frame_get(entry & 0xFFFFF000);
+        }
+    }
+
+    // The parent just lost write access to its pages
+    if (src == current_directory) {
+        flush_tlb();
+    }
     return dir;
 }
 
-void paging_init(void) {
+static uint32_t placement_alloc(uint32_t size) {
+    uint32_t addr = placement_address;
+    placement_address = (placement_address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return addr;
+}
+
+// Highest usable address below DIRECT_MAP_LIMIT, or the old fixed 16MB when
+// the BIOS gave us nothing to go on
+static uint32_t memory_top(const e820_map_t *map) {
+    if (!map || map->count == 0 || map->count > E820_MAX_ENTRIES) {
+        return 0x1000000;
+    }
+
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < map->count; i++) {
+        const e820_entry_t *e = &map->entries[i];
+        if (e->type != E820_USABLE || e->base >= DIRECT_MAP_LIMIT) continue;
+        uint64_t end = e->base + e->length;
+        if (end > DIRECT_MAP_LIMIT) end = DIRECT_MAP_LIMIT;
+        if (end > top) top = end;
+    }
+    return (uint32_t)top & ~(PAGE_SIZE - 1);
+}
+
+static void release_usable_memory(const e820_map_t *map, uint32_t top) {
+    if (!map || map->count == 0 || map->count > E820_MAX_ENTRIES) {
+        buddy_free_range(0, top);
+        return;
+    }
+
+    for (uint32_t i = 0; i < map->count; i++) {
+        const e820_entry_t *e = &map->entries[i];
+        if (e->type != E820_USABLE || e->base >= top) continue;
+        uint64_t end = e->base + e->length;
+        if (end > top) end = top;
+        buddy_free_range((uint32_t)e->base, (uint32_t)end);
+    }
+}
+
+static void reserve_range(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start & ~(PAGE_SIZE - 1); addr < end; addr += PAGE_SIZE) {
+        set_frame(addr);
+    }
+}
+
+// Give a kernel region page tables for as much of it as there is RAM to back.
+// Made up front, they are copied into every directory created afterwards.
+// Returns the end of the usable part.
+static uint32_t reserve_kernel_region(uint32_t start, uint32_t end, uint32_t ram) {
+    ram = (ram + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (end - start > ram) end = start + ram;
+    for (uint32_t addr = start; addr < end; addr += LARGE_PAGE_SIZE) {
+        if (!get_page(addr, true, kernel_directory)) return addr;
+    }
+    return end;
+}
+
+static const char *e820_type_name(uint32_t type) {
+    switch (type) {
+        case E820_USABLE:       return "usable";
+        case E820_RESERVED:     return "reserved";
+        case E820_ACPI_RECLAIM: return "ACPI data";
+        case E820_ACPI_NVS:     return "ACPI NVS";
+        case E820_BAD:          return "bad";
+        default:                return "unknown";
+    }
+}
+
+static void print_memory_map(const e820_map_t *map, uint32_t top, uint32_t kernel_reserved) {
+    if (!map || map->count == 0 || map->count > E820_MAX_ENTRIES) {
+        printf("No E820 memory map, assuming %u MB\n", top >> 20);
+    } else {
+        uint64_t usable = 0;
+        uint64_t reserved = 0;
+        printf("BIOS memory map:\n");
+        for (uint32_t i = 0; i < map->count; i++) {
+            const e820_entry_t *e = &map->entries[i];
+            printf("  0x%x - 0x%x %s\n", (uint32_t)e->base,
+                   (uint32_t)(e->base + e->length - 1), e820_type_name(e->type));
+            if (e->type == E820_USABLE) usable += e->length;
+            else reserved += e->length;
+        }
+        printf("Memory: %u KB usable, %u KB reserved by firmware\n",
+               (uint32_t)(usable >> 10), (uint32_t)(reserved >> 10));
+    }
+
+    printf("Frames: %u KB allocatable, %u KB held by kernel and frame map\n",
+           buddy_free_frames() * (PAGE_SIZE / 1024), kernel_reserved >> 10);
+}
+
+void paging_init(const e820_map_t *memory_map) {
     printf("Initializing paging...\n");
     
     // let's use a very simple identity mapping
     // This avoids complex page fault handling during boot
     
-    // Initialize frame bitmap for 16MB of RAM
-    nframes = 0x1000000 / PAGE_SIZE; // 16MB / 4KB
-    frames = (uint32_t*)kmalloc(nframes / 8); // 1 bit per frame
-    memset(frames, 0, nframes / 8);
+    // Size the frame allocator from the BIOS memory map. Its frame table
+    // is the first early allocation, so it must start past the whole
+    // .bss or it would overwrite kernel statics
+    uint32_t image_end = (uint32_t)&kernel_end;
+    if (image_end < (uint32_t)&ebss) image_end = (uint32_t)&ebss;
+    if (image_end < 0x100000) image_end = 0x100000;
+    placement_address = (image_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t top = memory_top(memory_map);
+    nframes = top / PAGE_SIZE;
+    buddy_init(nframes, (frame_info_t*)placement_alloc(nframes * sizeof(frame_info_t)));
+    release_usable_memory(memory_map, top);
+
+    // Low memory (real-mode data, boot stack), the kernel image and the
+    // early allocations above it stay out of the pool
+    reserve_range(0, placement_address);
+    print_memory_map(memory_map, top, placement_address);
     
-    // Create kernel page directory
-    kernel_directory = (page_directory_t *)kmalloc_a(sizeof(page_directory_t));
-    memset(kernel_directory, 0, sizeof(page_directory_t));
-    current_directory = kernel_directory;
+    // Create kernel page directory. It goes into CR3 straight away, so the
+    // mappings below edit it as the current directory; paging itself stays
+    // off until they are done.
+    kernel_directory = create_page_directory();
+    switch_page_directory(kernel_directory);
     
-    // Identity map first 8MB
-    printf("Identity mapping first 8MB...\n");
-    for (uint32_t i = 0; i < 0x800000; i += PAGE_SIZE) {
-        map_page(i, i, PAGE_PRESENT | PAGE_WRITABLE);
+    // The identity map is the same in every address space, so mark it
+    // global where supported and task switches will keep it in the TLB
+    uint32_t kernel_flags = PAGE_PRESENT | PAGE_WRITABLE;
+    global_pages = cpu_has_edx_feature(CPUID_EDX_PGE);
+    if (global_pages) {
+        kernel_flags |= PAGE_GLOBAL;
     }
     
-    printf("Switching to kernel page directory...\n");
-    switch_page_directory(kernel_directory);
+    // Identity map all of RAM (and at least the early allocations), with
+    // 4MB pages when the CPU supports them
+    uint32_t map_end = top > placement_address ? top : placement_address;
+    if (cpu_has_edx_feature(CPUID_EDX_PSE)) {
+        write_cr4(read_cr4() | CR4_PSE);
+        map_end = (map_end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+        printf("Identity mapping first %u MB with 4MB pages...\n", map_end >> 20);
+        for (uint32_t i = 0; i < map_end; i += LARGE_PAGE_SIZE) {
+            map_large_page(i, i, kernel_flags);
+        }
+    } else {
+        printf("Identity mapping first %u MB...\n", map_end >> 20);
+        for (uint32_t i = 0; i < map_end; i += PAGE_SIZE) {
+            map_page(i, i, kernel_flags);
+        }
+    }
+    
+    kernel_heap_end = reserve_kernel_region(KERNEL_HEAP_START, KERNEL_HEAP_END, top);
+    vmalloc_end = reserve_kernel_region(VMALLOC_START, VMALLOC_END, top);
+    printf("Kernel heap up to %u MB, vmalloc up to %u MB\n",
+           (kernel_heap_end - KERNEL_HEAP_START) >> 20, (vmalloc_end - VMALLOC_START) >> 20);
     
     printf("Enabling paging...\n");
     uint32_t cr0;
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     cr0 |= 0x80000000; // Set PG bit
+    cr0 |= 0x00010000; // Set WP so kernel writes honour copy-on-write too
     asm volatile("mov %0, %%cr0" : : "r"(cr0));
     
+    paging_active = true;
+    
+    // Global entries are only honoured once paging is on
+    if (global_pages) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+    
     printf("Paging enabled successfully\n");
 }
 
 void switch_page_directory(page_directory_t *dir) {
-    current_directory = dir;
-    asm volatile("mov %0, %%cr3" : : "r"(dir->physical_addr));
+    asm volatile("mov %0, %%cr3" : : "r"(page_directory_phys(dir)) : "memory");
+    tlb_stats.cr3_loads++;
+}
+
+// Page table entry for an address in `dir`, creating the table if asked to.
+// The current directory is edited through the self-map once paging is on;
+// any other directory is reached through the direct map.
+uint32_t *get_page(uint32_t virtual_addr, bool make, page_directory_t *dir) {
+    bool active = paging_active && dir == current_directory;
+    uint32_t *pde = active ? current_pde(virtual_addr) : &dir->entries[virtual_addr >> 22];
+    
+    // 4MB mappings have no page table to hand out
+    if (*pde & PAGE_LARGE) return NULL;
+    
+    if (!(*pde & PAGE_PRESENT)) {
+        if (!make) return NULL;
+
+        // Create new page table, preferably from the pre-zeroed pool
+        page_table_t *table = (page_table_t*)alloc_page(ALLOC_ZEROED);
+        if (!table) {
+            printf("ERROR: Out of memory for page table\n");
+            return NULL;
+        }
+        tables_in_use++;
+        *pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    
+    if (active) {
+        return current_pte(virtual_addr);
+    }
+    return &pde_table(*pde)->pages[(virtual_addr >> 12) & 0x3FF];
 }
 
 void map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+    uint32_t *page = get_page(virtual_addr, true, current_directory);
+    if (!page) return;
+
+    if (flags & PAGE_USER) {
+        current_directory->entries[virtual_addr >> 22] |= PAGE_USER;
+    }
+    
+    // Only a present entry can have been cached
+    uint32_t old = *page;
+    *page = (physical_addr & 0xFFFFF000) | flags;
+    if (old & PAGE_PRESENT) {
+        tlb_flush_page(virtual_addr);
+    }
+}
+
+void map_large_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
     uint32_t page_dir_index = virtual_addr >> 22;
-    uint32_t page_table_index = (virtual_addr >> 12) & 0x3FF;
-    
-    if (!current_directory->tables[page_dir_index]) {
-        // Create new page table
-        uint32_t tmp;
-        current_directory->tables[page_dir_index] = 
-            (page_table_t *)kmalloc_ap(sizeof(page_table_t), &tmp);
-        memset(current_directory->tables[page_dir_index], 0, sizeof(page_table_t));
-        current_directory->tables_physical[page_dir_index] = tmp | PAGE_PRESENT | PAGE_WRITABLE;
-        if (!(flags & PAGE_USER)) {
-            current_directory->tables_physical[page_dir_index] |= PAGE_USER;
-        }
+    uint32_t old = current_directory->entries[page_dir_index];
+    
+    if ((old & PAGE_PRESENT) && !(old & PAGE_LARGE) &&
+        pde_table(old) != pde_table(kernel_directory->entries[page_dir_index])) {
+        free_pages((uint32_t)pde_table(old), 0);
+        tables_in_use--;
     }
     
-    current_directory->tables[page_dir_index]->pages[page_table_index] = 
-        (physical_addr & 0xFFFFF000) | flags;
+    current_directory->entries[page_dir_index] =
+        (physical_addr & 0xFFC00000) | flags | PAGE_LARGE;
+    if (old & PAGE_PRESENT) {
+        tlb_flush_range(virtual_addr & ~(LARGE_PAGE_SIZE - 1),
+                        (virtual_addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE);
+    }
 }
 
-void unmap_page(uint32_t virtual_addr) {
+// Replace a 4MB mapping in `dir` with a page table of equivalent 4KB entries
+bool split_large_page(page_directory_t *dir, uint32_t virtual_addr) {
     uint32_t page_dir_index = virtual_addr >> 22;
-    uint32_t page_table_index = (virtual_addr >> 12) & 0x3FF;
+    uint32_t entry = dir->entries[page_dir_index];
+    if (!(entry & PAGE_LARGE)) return false;
+    
+    page_table_t *table = (page_table_t*)alloc_page(0); // Filled in below
+    if (!table) return false;
+    tables_in_use++;
+    
+    uint32_t base = entry & 0xFFC00000;
+    uint32_t flags = entry & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER);
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        table->pages[i] = (base + i * PAGE_SIZE) | flags | (entry & PAGE_GLOBAL);
+    }
+    dir->entries[page_dir_index] = (uint32_t)table | flags;
+    
+    if (dir == current_directory) {
+        tlb_flush_range(virtual_addr & ~(LARGE_PAGE_SIZE - 1),
+                        (virtual_addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE);
+    }
+    return true;
+}
+
+void unmap_page(uint32_t virtual_addr) {
+    uint32_t *page = get_page(virtual_addr, false, current_directory);
+    if (page && (*page & PAGE_PRESENT)) {
+        *page = 0;
+        tlb_flush_page(virtual_addr);
+    }
+}
+
+void tlb_flush_page(uint32_t virtual_addr) {
+    asm volatile("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    tlb_stats.page_flushes++;
+}
+
+void tlb_flush_range(uint32_t start, uint32_t end) {
+    start &= ~(PAGE_SIZE - 1);
+    if (end <= start) return;
     
-    if (current_directory->tables[page_dir_index]) {
-        current_directory->tables[page_dir_index]->pages[page_table_index] = 0;
+    if ((end - start) / PAGE_SIZE > TLB_FLUSH_RANGE_MAX) {
+        // A CR3 reload leaves global kernel entries behind
+        if (global_pages && (start < USER_SPACE_START || end > USER_SPACE_END)) {
+            tlb_flush_all();
+        } else {
+            flush_tlb();
+        }
+        return;
     }
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        tlb_flush_page(addr);
+    }
+}
+
+// Drop every translation, global ones included, by toggling CR4.PGE
+void tlb_flush_all(void) {
+    if (!global_pages) {
+        flush_tlb();
+        return;
+    }
+    uint32_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+    tlb_stats.full_flushes++;
+}
+
+void tlb_report(void) {
+    static tlb_stats_t last;
+    static uint32_t last_tick = 0;
+    
+    uint32_t now = get_tick_count();
+    uint32_t elapsed = now - last_tick;
+    if (elapsed == 0) elapsed = 1;
+    
+    printf("TLB (global pages %s), rates over the last %u ticks:\n",
+           global_pages ? "on" : "off", elapsed);
+    printf("event\ttotal\tper second\n");
+    printf("invlpg\t%u\t%u\n", tlb_stats.page_flushes,
+           (tlb_stats.page_flushes - last.page_flushes) * TIMER_HZ / elapsed);
+    printf("flush\t%u\t%u\n", tlb_stats.full_flushes,
+           (tlb_stats.full_flushes - last.full_flushes) * TIMER_HZ / elapsed);
+    printf("cr3\t%u\t%u\n", tlb_stats.cr3_loads,
+           (tlb_stats.cr3_loads - last.cr3_loads) * TIMER_HZ / elapsed);
+    printf("kept\t%u\t%u\n", tlb_stats.cr3_skipped,
+           (tlb_stats.cr3_skipped - last.cr3_skipped) * TIMER_HZ / elapsed);
+    
+    last = tlb_stats;
+    last_tick = now;
 }
 
 uint32_t get_physical_address(uint32_t virtual_addr) {
-    uint32_t page_dir_index = virtual_addr >> 22;
-    uint32_t page_table_index = (virtual_addr >> 12) & 0x3FF;
-    uint32_t page_offset = virtual_addr & 0xFFF;
+    if (!paging_active) return virtual_addr;
     
-    if (!current_directory->tables[page_dir_index]) {
-        return 0; // Page table doesn't exist
+    uint32_t dir_entry = *current_pde(virtual_addr);
+    if ((dir_entry & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+        return (dir_entry & 0xFFC00000) | (virtual_addr & 0x3FFFFF);
     }
     
-    uint32_t page_entry = current_directory->tables[page_dir_index]->pages[page_table_index];
-    if (!(page_entry & PAGE_PRESENT)) {
+    uint32_t *page = get_page(virtual_addr, false, current_directory);
+    if (!page || !(*page & PAGE_PRESENT)) {
         return 0; // Page not present
     }
     
-    return (page_entry & 0xFFFFF000) | page_offset;
+    return (*page & 0xFFFFF000) | (virtual_addr & 0xFFF);
+}
+
+// Resolve a write to a copy-on-write page. The last sharer simply gets write
+// access back; everyone else gets a private copy of the frame.
+static bool handle_cow_fault(uint32_t virtual_addr) {
+    uint32_t *page = get_page(virtual_addr, false, current_directory);
+    if (!page || !(*page & PAGE_PRESENT) || !(*page & PAGE_COW)) {
+        return false;
+    }
+
+    uint32_t frame = *page & 0xFFFFF000;
+    uint32_t flags = (*page & 0xFFF & ~PAGE_COW) | PAGE_WRITABLE;
+
+    if (frame_refcount(frame) == 1) {
+        *page = frame | flags;
+        cow_stats.reused++;
+    } else {
+        uint32_t copy = alloc_pages(0);
+        if (!copy) {
+            printf("ERROR: Out of memory resolving copy-on-write fault\n");
+            return false;
+        }
+        // Frames live in the identity map, so copy physical to physical
+        memcpy((void*)copy, (void*)frame, PAGE_SIZE);
+        frame_get(copy);
+        frame_put(frame);
+        *page = copy | flags;
+        cow_stats.copied++;
+    }
+
+    tlb_flush_page(virtual_addr);
+    return true;
 }
 
+bool paging_handle_fault(uint32_t virtual_addr, uint32_t error_code) {
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE)) {
+        return handle_cow_fault(virtual_addr);
+    }
+    return false;
+}
+
+// Kernel region tables are preallocated and shared, so edit them through the
+// kernel directory, which the direct map always reaches
+static uint32_t *kernel_pte(uint32_t virtual_addr) {
+    uint32_t entry = kernel_directory->entries[virtual_addr >> 22];
+    if (!(entry & PAGE_PRESENT)) return NULL;
+    return &pde_table(entry)->pages[(virtual_addr >> 12) & 0x3FF];
+}
+
+bool map_kernel_range(uint32_t start, uint32_t end) {
+    uint32_t flags = PAGE_PRESENT | PAGE_WRITABLE | (global_pages ? PAGE_GLOBAL : 0);
+    
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint32_t *page = kernel_pte(addr);
+        uint32_t frame = page ? alloc_page(0) : 0;
+        if (!frame) {
+            unmap_kernel_range(start, addr);
+            return false;
+        }
+        // The entry wasn't present, so there's nothing cached to flush
+        *page = frame | flags;
+    }
+    return true;
+}
+
+uint32_t unmap_kernel_range(uint32_t start, uint32_t end) {
+    uint32_t freed = 0;
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint32_t *page = kernel_pte(addr);
+        if (!page || !(*page & PAGE_PRESENT)) continue;
+        free_pages(*page & 0xFFFFF000, 0);
+        *page = 0;
+        freed++;
+    }
+    if (freed) {
+        tlb_flush_range(start, end);
+        tlb_shootdown(start, end);
+    }
+    return freed;
+}
+
+// The frame bitmap is gone; these are views over the buddy allocator's state
 void set_frame(uint32_t frame_addr) {
-    uint32_t frame = frame_addr / PAGE_SIZE;
-    if (frame >= nframes) return;
-    uint32_t idx = frame / 32;
-    uint32_t off = frame % 32;
-    frames[idx] |= (0x1 << off);
+    buddy_claim_frame(frame_addr / PAGE_SIZE);
 }
 
 void clear_frame(uint32_t frame_addr) {
-    uint32_t frame = frame_addr / PAGE_SIZE;
-    if (frame >= nframes) return;
-    uint32_t idx = frame / 32;
-    uint32_t off = frame % 32;
-    frames[idx] &= ~(0x1 << off);
+    if (test_frame(frame_addr)) {
+        free_pages(frame_addr, 0);
+    }
 }
 
 uint32_t test_frame(uint32_t frame_addr) {
     uint32_t frame = frame_addr / PAGE_SIZE;
     if (frame >= nframes) return 1; // Assume allocated if out of range
-    uint32_t idx = frame / 32;
-    uint32_t off = frame % 32;
-    return (frames[idx] & (0x1 << off));
+    return !buddy_frame_free(frame);
 }
 
 uint32_t first_free_frame(void) {
-    for (uint32_t i = 0; i < nframes / 32; i++) {
-        if (frames[i] != 0xFFFFFFFF) {
-            for (uint32_t j = 0; j < 32; j++) {
-                if (!(frames[i] & (0x1 << j))) {
-                    return i * 32 + j;
-                }
-            }
-        }
+    return buddy_any_free_frame(); // (uint32_t)-1 when there are none
+}
+
+// Back a user page with a freshly zeroed frame
+bool map_zero_page(page_directory_t *dir, uint32_t virtual_addr, bool is_writable) {
+    uint32_t *page = get_page(virtual_addr, true, dir);
+    if (!page) return false;
+    if (*page & PAGE_PRESENT) return true;
+
+    uint32_t frame = alloc_page(ALLOC_ZEROED);
+    if (!frame) {
+        printf("ERROR: Out of memory for demand-zero page\n");
+        return false;
+    }
+    frame_get(frame);
+
+    dir->entries[virtual_addr >> 22] |= PAGE_USER;
+    *page = frame | PAGE_PRESENT | PAGE_USER | (is_writable ? PAGE_WRITABLE : 0);
+    return true;
+}
+
+// Drop a user mapping and its frame reference
+void unmap_user_page(page_directory_t *dir, uint32_t virtual_addr) {
+    uint32_t *page = get_page(virtual_addr, false, dir);
+    if (!page || !(*page & PAGE_PRESENT)) return;
+
+    frame_put(*page & 0xFFFFF000);
+    *page = 0;
+    if (dir == current_directory) {
+        tlb_flush_page(virtual_addr);
+    }
+}
+
+// Reference counts track how many mappings share a frame; the frame goes
+// back to the buddy allocator when the last one is dropped
+void frame_get(uint32_t frame_addr) {
+    frame_info_t *info = buddy_frame_info(frame_addr / PAGE_SIZE);
+    if (info) __sync_add_and_fetch(&info->refcount, 1);
+}
+
+void frame_put(uint32_t frame_addr) {
+    frame_info_t *info = buddy_frame_info(frame_addr / PAGE_SIZE);
+    if (!info || info->refcount == 0) return;
+    if (__sync_sub_and_fetch(&info->refcount, 1) == 0) {
+        free_pages(frame_addr, 0);
     }
-    return (uint32_t)-1; // No free frames
+}
+
+void frame_report(void) {
+    uint32_t total = buddy_total_frames();
+    uint32_t free = buddy_free_frames();
+    uint32_t pooled = zero_pool_stats.depth;
+    
+    printf("Frames: %u total (%u MB)\n", total, total >> 8);
+    printf("  free %u, pre-zeroed %u, used %u\n", free, pooled, total - free - pooled);
+    printf("  page directories %u, page tables %u\n", directories_in_use, tables_in_use);
+    printf("  copy-on-write copies %u, reuses %u\n", cow_stats.copied, cow_stats.reused);
+}
+
+uint32_t frame_refcount(uint32_t frame_addr) {
+    frame_info_t *info = buddy_frame_info(frame_addr / PAGE_SIZE);
+    return info ? info->refcount : 0;
 }
 
 void alloc_frame(uint32_t virtual_addr, bool is_kernel, bool is_writable) {
-    uint32_t physical_addr = first_free_frame() * PAGE_SIZE;
-    if (physical_addr == (uint32_t)-1) {
+    alloc_frame_dir(current_directory, virtual_addr, is_kernel, is_writable);
+}
+
+void alloc_frame_dir(page_directory_t *dir, uint32_t virtual_addr, bool is_kernel, bool is_writable) {
+    uint32_t *page = get_page(virtual_addr, true, dir);
+    if (!page || (*page & PAGE_PRESENT)) return;
+
+    // User pages must never expose what the frame held before
+    uint32_t physical_addr = alloc_page(is_kernel ? 0 : ALLOC_ZEROED);
+    if (!physical_addr) {
         printf("ERROR: Out of memory in alloc_frame\n");
         return;
     }
-    
-    set_frame(physical_addr);
+    frame_get(physical_addr);
     
     uint32_t flags = PAGE_PRESENT;
     if (is_writable) flags |= PAGE_WRITABLE;
     if (!is_kernel) flags |= PAGE_USER;
     
-    map_page(virtual_addr, physical_addr, flags);
+    if (!is_kernel) {
+        dir->entries[virtual_addr >> 22] |= PAGE_USER;
+    }
+    *page = physical_addr | flags;
 }
\ No newline at end of file
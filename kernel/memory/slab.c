@@ -0,0 +1,124 @@
+#include "memory/slab.h"
+#include "memory/paging.h"
+#include "kernel.h"
+#include "spinlock.h"
+#include <string.h>
+#include <stddef.h>
+
+// Object caches for fixed-size kernel structures. Each cache grows one slab
+// at a time from page-aligned heap memory; freed objects go onto a per-cache
+// free list and are handed out again before any new slab is carved.
+
+static kmem_cache_t *cache_list = NULL;
+
+#define FREE_LINK(cache, obj) (*(void**)((uint32_t)(obj) + (cache)->link_offset))
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                uint32_t flags, kmem_ctor_t ctor) {
+    kmem_cache_t *cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    if (!cache) return NULL;
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name, SLAB_NAME_MAX - 1);
+
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size < sizeof(void*)) size = sizeof(void*);
+
+    cache->object_size = size;
+    cache->align = align;
+    cache->flags = flags;
+    cache->ctor = ctor;
+    spin_lock_init(&cache->lock);
+
+    // Constructed objects must survive a trip through the free list intact,
+    // so their link lives just past the object instead of inside it
+    uint32_t footprint = size;
+    if (ctor) {
+        cache->link_offset = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        footprint = cache->link_offset + sizeof(void*);
+    }
+    cache->stride = (footprint + align - 1) & ~(align - 1);
+
+    // Smallest whole number of pages that fits SLAB_MIN_OBJECTS objects
+    uint32_t bytes = cache->stride * SLAB_MIN_OBJECTS;
+    cache->slab_size = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    cache->objs_per_slab = cache->slab_size / cache->stride;
+
+    cache->next = cache_list;
+    cache_list = cache;
+    return cache;
+}
+
+static bool cache_grow(kmem_cache_t *cache) {
+    slab_t *slab = (slab_t*)kmalloc(sizeof(slab_t));
+    if (!slab) return false;
+
+    slab->base = kmalloc_a(cache->slab_size);
+    if (!slab->base) {
+        kfree(slab);
+        return false;
+    }
+
+    // Construct every object up front and thread them onto the free list
+    for (uint32_t i = 0; i < cache->objs_per_slab; i++) {
+        void *obj = (void*)(slab->base + i * cache->stride);
+        if (cache->flags & SLAB_ZERO) {
+            memset(obj, 0, cache->object_size);
+        }
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        FREE_LINK(cache, obj) = cache->free_list;
+        cache->free_list = obj;
+    }
+
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->slab_count++;
+    cache->total_objs += cache->objs_per_slab;
+    return true;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint32_t irq = spin_lock_irqsave(&cache->lock);
+    if (!cache->free_list && !cache_grow(cache)) {
+        spin_unlock_irqrestore(&cache->lock, irq);
+        return NULL;
+    }
+
+    void *obj = cache->free_list;
+    cache->free_list = FREE_LINK(cache, obj);
+    cache->active_objs++;
+    spin_unlock_irqrestore(&cache->lock, irq);
+
+    // Give back the word the free list borrowed from a zeroed object
+    if ((cache->flags & SLAB_ZERO) && cache->link_offset == 0) {
+        *(void**)obj = NULL;
+    }
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) return;
+
+    uint32_t irq = spin_lock_irqsave(&cache->lock);
+    FREE_LINK(cache, obj) = cache->free_list;
+    cache->free_list = obj;
+    cache->active_objs--;
+    spin_unlock_irqrestore(&cache->lock, irq);
+}
+
+void kmem_cache_report(void) {
+    printf("cache\t\tsize\tactive\ttotal\tslabs\twasted\n");
+    for (kmem_cache_t *c = cache_list; c; c = c->next) {
+        // Slack at the end of each slab plus per-object padding and links
+        uint32_t tail = c->slab_size - c->objs_per_slab * c->stride;
+        uint32_t padding = (c->stride - c->object_size) * c->objs_per_slab;
+        uint32_t wasted = (tail + padding) * c->slab_count;
+
+        printf("%s\t%s%u\t%u\t%u\t%u\t%u\n",
+               c->name, strlen(c->name) < 8 ? "\t" : "",
+               c->object_size, c->active_objs, c->total_objs,
+               c->slab_count, wasted);
+    }
+}
@@ -0,0 +1,78 @@
+#include "memory/vmalloc.h"
+#include "memory/paging.h"
+#include "kernel.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+// Areas are kept on a list sorted by address, and a new one goes in the
+// first gap big enough for it plus its guard page
+
+typedef struct vm_area {
+    uint32_t start;
+    uint32_t size; // Mapped bytes, not counting the guard page
+    struct vm_area *next;
+} vm_area_t;
+
+static vm_area_t *area_list = NULL;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+vmalloc_stats_t vmalloc_stats;
+
+void *vmalloc(uint32_t size) {
+    if (size == 0 || size > vmalloc_end - VMALLOC_START) return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
+    vm_area_t *area = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+    if (!area) return NULL;
+    
+    uint32_t irq = spin_lock_irqsave(&vmalloc_lock);
+    uint32_t start = VMALLOC_START;
+    vm_area_t **link = &area_list;
+    while (*link) {
+        if ((*link)->start - start >= size + PAGE_SIZE) break;
+        start = (*link)->start + (*link)->size + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    
+    if (start > vmalloc_end || vmalloc_end - start < size + PAGE_SIZE ||
+        !map_kernel_range(start, start + size)) {
+        vmalloc_stats.failures++;
+        spin_unlock_irqrestore(&vmalloc_lock, irq);
+        kfree(area);
+        return NULL;
+    }
+    
+    area->start = start;
+    area->size = size;
+    area->next = *link;
+    *link = area;
+    vmalloc_stats.areas++;
+    vmalloc_stats.pages += size / PAGE_SIZE;
+    spin_unlock_irqrestore(&vmalloc_lock, irq);
+    return (void*)start;
+}
+
+void vfree(void *addr) {
+    if (!addr) return;
+    
+    uint32_t irq = spin_lock_irqsave(&vmalloc_lock);
+    for (vm_area_t **link = &area_list; *link; link = &(*link)->next) {
+        vm_area_t *area = *link;
+        if (area->start != (uint32_t)addr) continue;
+        
+        unmap_kernel_range(area->start, area->start + area->size);
+        *link = area->next;
+        vmalloc_stats.areas--;
+        vmalloc_stats.pages -= area->size / PAGE_SIZE;
+        spin_unlock_irqrestore(&vmalloc_lock, irq);
+        kfree(area);
+        return;
+    }
+    spin_unlock_irqrestore(&vmalloc_lock, irq);
+}
+
+void vmalloc_report(void) {
+    printf("vmalloc: %u areas, %u KB mapped of %u KB, %u failures\n",
+           vmalloc_stats.areas, vmalloc_stats.pages * (PAGE_SIZE / 1024),
+           (vmalloc_end - VMALLOC_START) >> 10, vmalloc_stats.failures);
+}
@@ -0,0 +1,112 @@
+#include "memory/zero_pool.h"
+#include "memory/buddy.h"
+#include "memory/paging.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "fpu.h"
+#include <string.h>
+
+// Frames zeroed ahead of time by the idle loop. The pool is a stack linked
+// through frame_info_t.next, which is unused while a frame is allocated, so
+// the zeroed pages themselves are never written.
+
+zero_pool_stats_t zero_pool_stats = { 0, ZERO_POOL_DEFAULT, 0, 0, 0 };
+
+static uint32_t pool_head = BUDDY_NONE;
+static spinlock_t pool_lock = SPINLOCK_INIT;
+
+static void pool_push(uint32_t addr) {
+    uint32_t frame = addr / PAGE_SIZE;
+    buddy_frame_info(frame)->next = pool_head;
+    pool_head = frame;
+    zero_pool_stats.depth++;
+}
+
+static uint32_t pool_pop(void) {
+    uint32_t frame = pool_head;
+    if (frame == BUDDY_NONE) return 0;
+    pool_head = buddy_frame_info(frame)->next;
+    zero_pool_stats.depth--;
+    return frame * PAGE_SIZE;
+}
+
+uint32_t alloc_page(uint32_t flags) {
+    uint32_t irq = spin_lock_irqsave(&pool_lock);
+    uint32_t addr = 0;
+    bool zeroed = false;
+    
+    if (flags & ALLOC_ZEROED) {
+        addr = pool_pop();
+        zeroed = addr != 0;
+        if (zeroed) {
+            zero_pool_stats.hits++;
+        } else {
+            zero_pool_stats.misses++;
+        }
+    }
+    if (!addr) {
+        addr = alloc_pages(0);
+    }
+    if (!addr) {
+        // Out of free frames; pre-zeroed ones are still frames
+        addr = pool_pop();
+        zeroed = addr != 0;
+    }
+    spin_unlock_irqrestore(&pool_lock, irq);
+    
+    // The caller is about to use the page, so zero it through the cache
+    if (addr && (flags & ALLOC_ZEROED) && !zeroed) {
+        memset((void*)addr, 0, PAGE_SIZE); // Frames live in the identity map
+    }
+    return addr;
+}
+
+bool zero_pool_idle(void) {
+    // Never let the pool hold more than half of what's left free
+    if (zero_pool_stats.depth >= zero_pool_stats.high ||
+        buddy_free_frames() <= zero_pool_stats.high) {
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < ZERO_POOL_BATCH && zero_pool_stats.depth < zero_pool_stats.high; i++) {
+        uint32_t addr = alloc_pages(0);
+        if (!addr) return false;
+        
+        // Non-temporal stores when available: nobody reads these pages soon
+        if (sse2_available()) {
+            kernel_fpu_begin();
+            sse_zero_page((void*)addr);
+            kernel_fpu_end();
+        } else {
+            memset((void*)addr, 0, PAGE_SIZE);
+        }
+        
+        uint32_t irq = spin_lock_irqsave(&pool_lock);
+        pool_push(addr);
+        zero_pool_stats.scrubbed++;
+        spin_unlock_irqrestore(&pool_lock, irq);
+    }
+    return true;
+}
+
+void zero_pool_set_high(uint32_t frames) {
+    if (frames > ZERO_POOL_MAX) frames = ZERO_POOL_MAX;
+    
+    uint32_t irq = spin_lock_irqsave(&pool_lock);
+    zero_pool_stats.high = frames;
+    while (zero_pool_stats.depth > frames) {
+        free_pages(pool_pop(), 0);
+    }
+    spin_unlock_irqrestore(&pool_lock, irq);
+}
+
+void zero_pool_report(void) {
+    zero_pool_stats_t s = zero_pool_stats;
+    uint32_t requests = s.hits + s.misses;
+    
+    printf("Zero pool: %u of %u frames ready\n", s.depth, s.high);
+    printf("hits\tmisses\thit %%\tscrubbed\n");
+    printf("%u\t%u\t%u\t%u\n", s.hits, s.misses,
+           requests ? s.hits * 100 / requests : 0, s.scrubbed);
+}
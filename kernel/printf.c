@@ -18,24 +18,15 @@ void puts(const char *str) {
 
 // Basic keyboard input function
 char getchar_blocking(void) {
-    char c = 0;
-    while (c == 0) {
-        if (keyboard_data_available()) {
-            c = keyboard_get_char();
-            if (c != 0) {
-                // Echo the character
-                if (c == '\b') {
-                    putchar('\b');
-                } else if (c == '\n' || c == '\r') {
-                    putchar('\n');
-                } else if (c >= 32 && c <= 126) {
-                    putchar(c);
-                }
-                return c;
-            }
-        }
-        // Give CPU a break
-        asm volatile("hlt");
+    char c = keyboard_read_char();
+    
+    // Echo the character
+    if (c == '\b') {
+        putchar('\b');
+    } else if (c == '\n' || c == '\r') {
+        putchar('\n');
+    } else if (c >= 32 && c <= 126) {
+        putchar(c);
     }
     return c;
 }
@@ -1,42 +1,111 @@
 #include "process.h"
+#include "sched.h"
 #include "kernel.h"
 #include "memory/paging.h"
+#include "memory/slab.h"
+#include "fpu.h"
+#include "cpu.h"
+#include "spinlock.h"
 #include <string.h>
 #include <stddef.h>
 
-process_t *current_process = NULL;
 process_t *process_list = NULL;
 static uint32_t next_pid = 1;
 
+// Guards pid allocation, process_list, the pid hash and child lists
+static spinlock_t process_lock = SPINLOCK_INIT;
+
+static kmem_cache_t *process_cache = NULL;
+static kmem_cache_t *kstack_cache = NULL;
+
+// Chains of processes whose pids share their low bits
+static process_t *pid_hash[PID_HASH_SIZE];
+
+// First code a new task runs, from context_switch's final ret
+extern void task_trampoline(void);
+
+static void alarm_expired(ktimer_t *timer);
+
 void process_init(void) {
-    // Create initial kernel process
-    current_process = create_process("kernel", NULL, true);
-    current_process->state = PROCESS_RUNNING;
-    process_list = current_process;
+    process_cache = kmem_cache_create("process", sizeof(process_t), 8, 0, NULL);
+    kstack_cache = kmem_cache_create("kernel_stack", KERNEL_STACK_SIZE, 16, 0, NULL);
+
+    // The boot thread carries on as the first CPU's idle task
+    sched_init(create_process("kernel", NULL, true));
+}
+
+// Push onto the front of a list threaded through the given fields
+#define LIST_PUSH(head, proc, next, prev) do {  \
+        (proc)->prev = NULL;                    \
+        (proc)->next = (head);                  \
+        if (head) (head)->prev = (proc);        \
+        (head) = (proc);                        \
+    } while (0)
+
+#define LIST_REMOVE(head, proc, next, prev) do {            \
+        if ((proc)->prev) (proc)->prev->next = (proc)->next; \
+        else (head) = (proc)->next;                         \
+        if ((proc)->next) (proc)->next->prev = (proc)->prev; \
+        (proc)->next = (proc)->prev = NULL;                 \
+    } while (0)
+
+static inline process_t **pid_bucket(uint32_t pid) {
+    return &pid_hash[pid & (PID_HASH_SIZE - 1)];
+}
+
+static void add_child(process_t *parent, process_t *child) {
+    child->parent = parent;
+    child->ppid = parent->pid;
+    LIST_PUSH(parent->children, child, sibling_next, sibling_prev);
+    parent->child_count++;
+}
+
+static void remove_child(process_t *child) {
+    process_t *parent = child->parent;
+    LIST_REMOVE(parent->children, child, sibling_next, sibling_prev);
+    parent->child_count--;
+    child->parent = NULL;
+    child->ppid = 0;
 }
 
 process_t *create_process(const char *name, void (*entry_point)(void), bool kernel_mode) {
-    process_t *proc = (process_t*)kmalloc(sizeof(process_t)); 
+    process_t *proc = (process_t*)kmem_cache_alloc(process_cache);
     if (!proc) return NULL;
     
     memset(proc, 0, sizeof(process_t));
     
-    proc->pid = next_pid++;
     strncpy(proc->name, name, PROCESS_NAME_MAX - 1);
-    proc->state = PROCESS_READY;
-    proc->priority = 10;
-    proc->time_slice = 10; // 10 timer ticks
+    proc->state = PROCESS_BLOCKED; // Until it has something to run
+    proc->priority = PRIORITY_DEFAULT;
+    proc->static_priority = PRIORITY_DEFAULT;
+    proc->time_slice = SCHED_TIME_SLICE;
+    proc->cpu = smp_processor_id();
+    ktimer_init(&proc->alarm, alarm_expired, proc);
     
     // Allocate kernel stack
-    proc->kernel_stack = (uint32_t)kmalloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
+    void *stack = kmem_cache_alloc(kstack_cache);
+    if (!stack) {
+        kmem_cache_free(process_cache, proc);
+        return NULL;
+    }
+    proc->kernel_stack = (uint32_t)stack + KERNEL_STACK_SIZE;
     
     if (!kernel_mode) {
         // Create user address space
         proc->page_directory = create_page_directory();
+        if (!proc->page_directory) {
+            kmem_cache_free(kstack_cache, stack);
+            kmem_cache_free(process_cache, proc);
+            return NULL;
+        }
         
-        // Allocate user stack at high memory
-        proc->user_stack = 0xC0000000;
-        alloc_frame(proc->user_stack - PAGE_SIZE, false, true);
+        // Reserve the heap and stack; pages are only backed when touched
+        proc->heap.start = USER_HEAP_START;
+        proc->heap.end = USER_HEAP_START;
+        proc->stack.start = USER_STACK_TOP - USER_STACK_INITIAL;
+        proc->stack.end = USER_STACK_TOP;
+        proc->stack.limit = USER_STACK_TOP - USER_STACK_MAX;
+        proc->user_stack = USER_STACK_TOP;
         
         // Set up initial CPU state for user mode
         proc->cpu_state.cs = 0x1B; // User code segment
@@ -51,156 +120,320 @@ process_t *create_process(const char *name, void (*entry_point)(void), bool kern
         proc->cpu_state.esp = proc->kernel_stack;
     }
     
+    proc->cpu_state.cr3 = page_directory_phys(proc->page_directory);
+    
     if (entry_point) {
+        // The frame context_switch pops: callee-saved registers, with the
+        // entry point parked in EBX, and a return into the trampoline
+        uint32_t *sp = (uint32_t*)proc->kernel_stack;
+        *--sp = (uint32_t)task_trampoline;
+        *--sp = 0;                      // EBP
+        *--sp = (uint32_t)entry_point;  // EBX
+        *--sp = 0;                      // ESI
+        *--sp = 0;                      // EDI
+        proc->kernel_sp = (uint32_t)sp;
         proc->cpu_state.eip = (uint32_t)entry_point;
     }
     
-    proc->cpu_state.cr3 = proc->page_directory->physical_addr;
-    
     // Add to process list
-    proc->next = process_list;
-    process_list = proc;
+    uint32_t irq = spin_lock_irqsave(&process_lock);
+    proc->pid = next_pid++;
+    LIST_PUSH(process_list, proc, next, prev);
+    LIST_PUSH(*pid_bucket(proc->pid), proc, hash_next, hash_prev);
+    spin_unlock_irqrestore(&process_lock, irq);
+    if (entry_point) {
+        sched_set_state(proc, PROCESS_READY);
+    }
     
     return proc;
 }
 
 void destroy_process(process_t *proc) {
     if (!proc) return;
+    sched_set_state(proc, PROCESS_TERMINATED);
+    ktimer_cancel(&proc->alarm);
+    
+    // An exiting task may still be switching away on another CPU
+    while (proc->on_cpu) {
+        cpu_relax();
+    }
     
     // Remove from process list
-    if (process_list == proc) {
-        process_list = proc->next;
-    } else {
-        process_t *current = process_list;
-        while (current && current->next != proc) {
-            current = current->next;
-        }
-        if (current) {
-            current->next = proc->next;
-        }
+    uint32_t irq = spin_lock_irqsave(&process_lock);
+    LIST_REMOVE(process_list, proc, next, prev);
+    LIST_REMOVE(*pid_bucket(proc->pid), proc, hash_next, hash_prev);
+    if (proc->parent) {
+        remove_child(proc);
     }
+    while (proc->children) {
+        remove_child(proc->children);
+    }
+    spin_unlock_irqrestore(&process_lock, irq);
     
     // Free resources
+    fpu_release(proc);
     if (proc->page_directory != kernel_directory) {
         // Free user page directory
-        kfree(proc->page_directory);
+        destroy_page_directory(proc->page_directory);
     }
     
-    kfree((void*)(proc->kernel_stack - KERNEL_STACK_SIZE));
-    kfree(proc);
+    kmem_cache_free(kstack_cache, (void*)(proc->kernel_stack - KERNEL_STACK_SIZE));
+    kmem_cache_free(process_cache, proc);
 }
 
+// Run the highest-priority ready process. A process that is still runnable
+// keeps the CPU against lower levels and goes behind its equals.
 void schedule(void) {
     if (!current_process) return;
     
-    // Simple round-robin scheduler
-    process_t *next = current_process->next;
-    if (!next) next = process_list;
-    
-    // Find next ready process
-    while (next && next->state != PROCESS_READY && next != current_process) {
-        next = next->next;
-        if (!next) next = process_list;
-    }
-    
-    if (next && next != current_process && next->state == PROCESS_READY) {
-        current_process->state = PROCESS_READY;
+    uint32_t irq = irq_save();
+    process_t *next = sched_next_task(current_process);
+    // A task that blocked can be woken and picked again before it's gone
+    if (next && next != current_process) {
         switch_task(next);
     }
+    irq_restore(irq);
 }
 
+// Interrupts are off and `next` has already been taken off the queues
 void switch_task(process_t *next) {
-    if (!next || next == current_process) return;
+    cpu_t *cpu = this_cpu();
+    process_t *prev = cpu->current;
+    if (!next || next == prev) return;
+    
+    cpu->current = next;
+    cpu->prev = prev;
+    next->on_cpu = true;
+    cpu->stats.switches++;
     
-    process_t *prev = current_process;
-    current_process = next;
-    current_process->state = PROCESS_RUNNING;
+    // Kernel threads share a directory; reloading CR3 would only throw
+    // away their TLB entries
+    if (next->page_directory != prev->page_directory) {
+        switch_page_directory(next->page_directory);
+    } else {
+        tlb_stats.cr3_skipped++;
+    }
     
-    // Switch page directory
-    switch_page_directory(current_process->page_directory);
+    // Arm the #NM trap unless the FPU already holds this task's registers
+    fpu_switch(prev, next);
     
-    // Perform context switch (assembly required)
-    context_switch(&prev->cpu_state, &current_process->cpu_state);
+    // Returns once something switches back to prev, possibly on another CPU
+    context_switch(&prev->kernel_sp, next->kernel_sp);
+    sched_finish_switch();
+}
+
+process_t *find_process(uint32_t pid) {
+    uint32_t irq = spin_lock_irqsave(&process_lock);
+    process_t *proc = *pid_bucket(pid);
+    while (proc && proc->pid != pid) {
+        proc = proc->hash_next;
+    }
+    spin_unlock_irqrestore(&process_lock, irq);
+    return proc;
+}
+
+uint32_t process_snapshot(process_sample_t *samples, uint32_t max) {
+    uint32_t count = 0;
+    uint32_t irq = spin_lock_irqsave(&process_lock);
+    for (process_t *proc = process_list; proc; proc = proc->next, count++) {
+        if (count >= max) continue;
+        process_sample_t *sample = &samples[count];
+        sample->pid = proc->pid;
+        memcpy(sample->name, proc->name, PROCESS_NAME_MAX);
+        sample->state = proc->state;
+        sample->cpu = proc->cpu;
+        sample->priority = proc->priority;
+        sample->utime = proc->utime;
+        sample->stime = proc->stime;
+        sample->run_cycles = proc->run_cycles;
+        sample->irq_cycles = proc->irq_cycles;
+        sample->wait_cycles = proc->wait_cycles;
+        sample->nvcsw = proc->nvcsw;
+        sample->nivcsw = proc->nivcsw;
+    }
+    spin_unlock_irqrestore(&process_lock, irq);
+    return count;
+}
+
+static inline bool region_contains(const vm_region_t *region, uint32_t addr) {
+    return addr >= region->start && addr < region->end;
+}
+
+// Demand-zero paging: the first touch of a reserved heap or stack page maps a
+// zeroed frame, and touching just below the stack grows it down
+bool process_handle_fault(uint32_t virtual_addr, uint32_t error_code) {
+    process_t *proc = current_process;
+    if (!proc || proc->page_directory == kernel_directory) return false;
+    if (error_code & PF_PRESENT) return false;
+
+    uint32_t page = virtual_addr & ~(PAGE_SIZE - 1);
+    if (!region_contains(&proc->heap, virtual_addr) &&
+        !region_contains(&proc->stack, virtual_addr)) {
+        if (virtual_addr < proc->stack.limit || virtual_addr >= proc->stack.start) {
+            return false;
+        }
+        proc->stack.start = page;
+    }
+
+    return map_zero_page(proc->page_directory, page, true);
+}
+
+// Move the program break. Growing only moves the boundary; shrinking also
+// releases whatever pages were backed above the new break.
+uint32_t process_brk(process_t *proc, uint32_t addr) {
+    if (!proc || proc->page_directory == kernel_directory) return 0;
+    if (addr < proc->heap.start || addr > proc->stack.limit) {
+        return proc->heap.end;
+    }
+
+    uint32_t old_top = (proc->heap.end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t new_top = (addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (uint32_t page = new_top; page < old_top; page += PAGE_SIZE) {
+        unmap_user_page(proc->page_directory, page);
+    }
+
+    proc->heap.end = addr;
+    return addr;
+}
+
+// There is no signal delivery yet, so an expired alarm only leaves
+// SIGALRM pending
+static void alarm_expired(ktimer_t *timer) {
+    process_t *proc = (process_t*)timer->data;
+    proc->signals_pending |= 1u << SIGALRM;
+}
+
+// Raise SIGALRM after `seconds`, replacing any earlier alarm; 0 only
+// cancels. Returns the seconds the earlier alarm had left, rounded up.
+uint32_t process_alarm(process_t *proc, uint32_t seconds) {
+    uint32_t left = 0;
+    uint32_t irq = irq_save();
+    if (ktimer_cancel(&proc->alarm)) {
+        uint32_t ticks = proc->alarm.expires - get_tick_count();
+        left = (int32_t)ticks > 0 ? (ticks + TIMER_HZ - 1) / TIMER_HZ : 1;
+    }
+    if (seconds) {
+        ktimer_add(&proc->alarm, get_tick_count() + seconds * TIMER_HZ);
+    }
+    irq_restore(irq);
+    return left;
 }
 
 uint32_t fork(void) {
     if (!current_process) return -1;
+    process_t *parent = current_process;
     
-    // Create child process
-    process_t *child = create_process(current_process->name, NULL, false);
+    // Create child process; its address space is set up below. It has no
+    // kernel context to resume, so it isn't made runnable.
+    process_t *child = create_process(parent->name, NULL, true);
     if (!child) return -1;
     
-    // Copy parent's memory space
-    // This requires implementing copy-on-write or full memory copy
+    // Share the parent's memory copy-on-write rather than copying it
+    if (parent->page_directory != kernel_directory) {
+        child->page_directory = clone_directory(parent->page_directory);
+        if (!child->page_directory) {
+            child->page_directory = kernel_directory;
+            destroy_process(child);
+            return -1;
+        }
+    }
+    if (!fpu_fork(parent, child)) {
+        destroy_process(child);
+        return -1;
+    }
+    child->user_stack = parent->user_stack;
+    child->heap = parent->heap;
+    child->stack = parent->stack;
     
     // Set up parent-child relationship
-    child->ppid = current_process->pid;
-    child->parent = current_process;
+    uint32_t irq = spin_lock_irqsave(&process_lock);
+    add_child(parent, child);
+    spin_unlock_irqrestore(&process_lock, irq);
     
-    // Copy CPU state from parent
-    memcpy(&child->cpu_state, &current_process->cpu_state, sizeof(cpu_state_t));
+    // Copy CPU state from parent; the child sees fork() return 0
+    memcpy(&child->cpu_state, &parent->cpu_state, sizeof(cpu_state_t));
+    child->cpu_state.eax = 0;
+    child->cpu_state.cr3 = page_directory_phys(child->page_directory);
     
-    // Return 0 to child, child PID to parent
-    if (current_process == child) {
-        return 0; // Child process
-    } else {
-        return child->pid; // Parent process
-    }
+    return child->pid; // Parent process
 }
 
 void exit(int status) {
-    (void)status; // Suppress unused parameter warning
     if (!current_process) return;
     
-    current_process->state = PROCESS_TERMINATED;
+    uint32_t irq = irq_save();
+    current_process->exit_status = status;
+    sched_set_state(current_process, PROCESS_TERMINATED);
     
     // Wake up parent if waiting
-    if (current_process->parent && 
-        current_process->parent->state == PROCESS_BLOCKED) {
-        current_process->parent->state = PROCESS_READY;
+    if (current_process->parent) {
+        wake_up(&current_process->parent->child_exit);
     }
     
     // Schedule next process
     schedule();
+    irq_restore(irq);
 }
 
-int wait(int *status) {
-    // Stub implementation
-    (void)status;
-    return -1;
+// Entry points that return end up here, via the trampoline
+void task_exit(void) {
+    exit(0);
 }
 
-extern void context_switch(void *prev_state, void *next_state);
+// Called from inside wait_event, so interrupts are already off
+static process_t *find_exited_child(process_t *parent) {
+    spin_lock(&process_lock);
+    process_t *proc = parent->children;
+    while (proc && proc->state != PROCESS_TERMINATED) {
+        proc = proc->sibling_next;
+    }
+    spin_unlock(&process_lock);
+    return proc;
+}
+
+// Block until a child exits, then reap it. Returns its pid, or -1 if the
+// caller has no children.
+int wait(int *status) {
+    process_t *self = current_process;
+    process_t *child;
+    
+    wait_event(&self->child_exit, (child = find_exited_child(self)) || !self->children);
+    if (!child) return -1;
+    
+    int pid = child->pid;
+    if (status) *status = child->exit_status;
+    destroy_process(child);
+    return pid;
+}
 
-// Assembly context switch implementation
+// Switch kernel stacks. Everything the C calling convention lets a callee
+// clobber is already dead at the call, so only EBX, ESI, EDI and EBP need
+// to survive on the outgoing stack; EFLAGS rides along in the caller, which
+// always switches with interrupts off. The address space is switch_task's
+// job, done beforehand, since kernel stacks are mapped everywhere.
 asm(
     ".global context_switch\n"
     "context_switch:\n"
+    "    mov 4(%esp), %eax\n"   // prev_sp
+    "    mov 8(%esp), %edx\n"   // next_sp
     "    push %ebp\n"
-    "    mov %esp, %ebp\n"
-    "    push %eax\n"
     "    push %ebx\n"
-    "    push %ecx\n"
-    "    push %edx\n"
     "    push %esi\n"
     "    push %edi\n"
-    "    pushf\n"
-    "    \n"
-    "    mov 8(%ebp), %eax\n"
-    "    mov %esp, 16(%eax)\n"
-    "    \n"
-    "    mov 12(%ebp), %eax\n"
-    "    mov 16(%eax), %esp\n"
-    "    mov 20(%eax), %ebx\n"
-    "    mov %ebx, %cr3\n"
-    "    \n"
-    "    popf\n"
+    "    mov %esp, (%eax)\n"
+    "    mov %edx, %esp\n"
     "    pop %edi\n"
     "    pop %esi\n"
-    "    pop %edx\n"
-    "    pop %ecx\n"
     "    pop %ebx\n"
-    "    pop %eax\n"
     "    pop %ebp\n"
     "    ret\n"
-);
\ No newline at end of file
+    "\n"
+    // A new task arrives here with the entry point in EBX, still inside
+    // the schedule() call that picked it, so interrupts are off
+    ".global task_trampoline\n"
+    "task_trampoline:\n"
+    "    call sched_finish_switch\n"
+    "    sti\n"
+    "    call *%ebx\n"
+    "    call task_exit\n"
+);
@@ -1,6 +1,32 @@
 #include "run_shell.h"
 #include "kernel.h"
 #include "terminal.h"
+#include "memory/slab.h"
+#include "memory/paging.h"
+#include "memory/zero_pool.h"
+#include "memory/vmalloc.h"
+#include "bench.h"
+#include "clock.h"
+#include "timer.h"
+#include "smp.h"
+#include "softirq.h"
+#include "workqueue.h"
+#include "top.h"
+#include <string.h>
+
+#define MEMINFO_LEAKS_SHOWN 40
+
+// Decimal argument for commands that take one; false if it isn't a number
+static bool parse_uint(const char *s, uint32_t *out) {
+    uint32_t value = 0;
+    if (*s == '\0') return false;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') return false;
+        value = value * 10 + (*s - '0');
+    }
+    *out = value;
+    return true;
+}
 
 void run_shell() {
     char command[256];
@@ -19,6 +45,16 @@ void run_shell() {
             print_message("  exit    - Exit shell\n");
             print_message("  ls      - List files\n");
             print_message("  users   - List users\n");
+            print_message("  slabinfo - Show kernel object caches\n");
+            print_message("  meminfo [leaks] - Show heap, vmalloc and frame usage\n");
+            print_message("  tlbinfo - Show TLB flush counts\n");
+            print_message("  uptime  - Show time since boot and the clock source\n");
+            print_message("  tickless [on|off] - Show idle and busy timer wakeups or toggle tickless idle\n");
+            print_message("  cpus    - Show online CPUs and their run queues\n");
+            print_message("  irqinfo - Show softirq, workqueue and interrupts-off times\n");
+            print_message("  top [n] - Show the busiest processes every second, n times or until a key\n");
+            print_message("  zeropool [frames] - Show the zeroed page pool or set its size\n");
+            print_message("  bench [name] - Run a kernel benchmark\n");
         } else if (strcmp(command, "clear") == 0) {
             clear_screen();
         } else if (strcmp(command, "exit") == 0) {
@@ -28,6 +64,50 @@ void run_shell() {
             list_files();
         } else if (strcmp(command, "users") == 0) {
             list_users();
+        } else if (strcmp(command, "slabinfo") == 0) {
+            kmem_cache_report();
+        } else if (strcmp(command, "meminfo") == 0) {
+            heap_report();
+            vmalloc_report();
+            frame_report();
+        } else if (strcmp(command, "meminfo leaks") == 0) {
+            heap_leak_report(MEMINFO_LEAKS_SHOWN);
+        } else if (strcmp(command, "tlbinfo") == 0) {
+            tlb_report();
+        } else if (strcmp(command, "uptime") == 0) {
+            clock_report();
+        } else if (strcmp(command, "tickless") == 0) {
+            timer_report();
+        } else if (strcmp(command, "tickless on") == 0) {
+            timer_set_tickless(true);
+            timer_report();
+        } else if (strcmp(command, "tickless off") == 0) {
+            timer_set_tickless(false);
+            timer_report();
+        } else if (strcmp(command, "cpus") == 0) {
+            smp_report();
+        } else if (strcmp(command, "top") == 0) {
+            top_run(0);
+        } else if (strncmp(command, "top ", 4) == 0) {
+            uint32_t refreshes;
+            if (parse_uint(command + 4, &refreshes)) {
+                top_run(refreshes);
+            }
+        } else if (strcmp(command, "irqinfo") == 0) {
+            softirq_report();
+            workqueue_report();
+        } else if (strcmp(command, "zeropool") == 0) {
+            zero_pool_report();
+        } else if (strncmp(command, "zeropool ", 9) == 0) {
+            uint32_t frames;
+            if (parse_uint(command + 9, &frames)) {
+                zero_pool_set_high(frames);
+            }
+            zero_pool_report();
+        } else if (strcmp(command, "bench") == 0) {
+            bench_list();
+        } else if (strncmp(command, "bench ", 6) == 0) {
+            bench_run(command + 6);
         } else if (strlen(command) > 0) {
             print_message("Unknown command: ");
             print_message(command);
@@ -0,0 +1,373 @@
+#include "sched.h"
+#include "cpu.h"
+#include "wait.h"
+#include "softirq.h"
+#include <stddef.h>
+
+// Ready processes sit on one FIFO list per priority level, and a bitmap of
+// the non-empty levels lets the next one be found with a single bsf
+// instead of a walk over every process.
+//
+// The timer tick ends slices and interrupts wake sleepers; either may set
+// need_resched, which is acted on as the interrupt returns. A task's level
+// is its static priority raised by how much of the last second it spent
+// asleep, so interactive tasks get in ahead of CPU hogs.
+//
+// Each CPU has its own queue and lock. A task is queued on the CPU it last
+// ran on, where its cache lines are likely still warm; a CPU with nothing
+// better than its idle task takes the best task from the busiest other
+// queue instead. Idle tasks are never queued.
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+uint32_t sched_loadavg[3];
+
+// Tasks waiting for any interrupt, and how many have been handled
+static wait_queue_t irq_wait = WAIT_QUEUE_INIT;
+static volatile uint32_t irq_count = 0;
+
+void sched_init_cpu(cpu_t *cpu, process_t *idle) {
+    cpu->idle = idle;
+    cpu->current = idle;
+    idle->static_priority = PRIORITY_IDLE;
+    idle->priority = PRIORITY_IDLE;
+    idle->state = PROCESS_RUNNING;
+    idle->cpu = cpu->id;
+    idle->on_cpu = true;
+    idle->pinned = true;
+    cpu->switch_tsc = rdtsc();
+}
+
+void sched_init(process_t *idle) {
+    sched_init_cpu(&cpus[0], idle);
+}
+
+static uint32_t effective_priority(process_t *proc) {
+    if (proc->static_priority == PRIORITY_IDLE) return PRIORITY_IDLE;
+    uint32_t bonus = proc->sleep_avg * INTERACTIVE_BONUS / SLEEP_AVG_MAX;
+    return proc->static_priority > bonus ? proc->static_priority - bonus : PRIORITY_HIGHEST;
+}
+
+// The queue a task belongs to changes when it's stolen, so check it again
+// once the lock is held
+static cpu_t *task_rq_lock(process_t *proc, uint32_t *irq) {
+    *irq = irq_save();
+    for (;;) {
+        cpu_t *cpu = &cpus[proc->cpu];
+        spin_lock(&cpu->lock);
+        if (proc->cpu == cpu->id) return cpu;
+        spin_unlock(&cpu->lock);
+    }
+}
+
+static void rq_enqueue(cpu_t *cpu, process_t *proc) {
+    proc->priority = effective_priority(proc);
+    if (proc == cpu->idle) return;
+
+    run_queue_t *rq = &cpu->run_queue;
+    run_list_t *list = &rq->levels[proc->priority];
+    proc->run_next = NULL;
+    proc->run_prev = list->tail;
+    if (list->tail) list->tail->run_next = proc;
+    else list->head = proc;
+    list->tail = proc;
+
+    rq->bitmap |= 1u << proc->priority;
+    rq->nr_ready++;
+}
+
+static void rq_dequeue(cpu_t *cpu, process_t *proc) {
+    if (proc == cpu->idle) return;
+
+    run_queue_t *rq = &cpu->run_queue;
+    run_list_t *list = &rq->levels[proc->priority];
+    if (proc->run_prev) proc->run_prev->run_next = proc->run_next;
+    else list->head = proc->run_next;
+    if (proc->run_next) proc->run_next->run_prev = proc->run_prev;
+    else list->tail = proc->run_prev;
+    proc->run_next = proc->run_prev = NULL;
+
+    if (!list->head) rq->bitmap &= ~(1u << proc->priority);
+    rq->nr_ready--;
+}
+
+static void resched_cpu(cpu_t *cpu) {
+    if (cpu->need_resched) return;
+    cpu->need_resched = true;
+    if (cpu != this_cpu()) {
+        smp_send_reschedule(cpu->id);
+    }
+}
+
+// A task just queued on `cpu` preempts what's running there if it ranks
+// higher; otherwise an idle CPU is woken to come and steal it
+static void check_preempt(cpu_t *cpu, process_t *proc) {
+    process_t *running = cpu->current;
+    if (proc == running) return;
+    if (running->state == PROCESS_RUNNING && proc->priority < running->priority) {
+        resched_cpu(cpu);
+        return;
+    }
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_t *other = &cpus[i];
+        if (other != cpu && other->online && other->current == other->idle) {
+            resched_cpu(other);
+            return;
+        }
+    }
+}
+
+// Charge the running task for its time on the CPU up to `now`
+static void account_run(cpu_t *cpu, process_t *proc, uint64_t now) {
+    proc->run_cycles += now - cpu->switch_tsc;
+    cpu->switch_tsc = now;
+}
+
+// A task taken off a queue to run: charge its wait there
+static void account_wait(process_t *proc) {
+    proc->wait_cycles += rdtsc() - proc->ready_tsc;
+}
+
+// Called with the task's queue locked
+static void set_state_locked(cpu_t *cpu, process_t *proc, process_state_t state) {
+    if (proc->state == state) return;
+    if (proc->state == PROCESS_READY) rq_dequeue(cpu, proc);
+    proc->state = state;
+    if (state == PROCESS_READY) {
+        proc->ready_tsc = rdtsc();
+        rq_enqueue(cpu, proc);
+        check_preempt(cpu, proc);
+    }
+}
+
+void sched_set_state(process_t *proc, process_state_t state) {
+    uint32_t irq;
+    cpu_t *cpu = task_rq_lock(proc, &irq);
+    set_state_locked(cpu, proc, state);
+    spin_unlock_irqrestore(&cpu->lock, irq);
+}
+
+bool sched_set_priority(process_t *proc, uint32_t priority) {
+    if (priority > PRIORITY_LOWEST || proc->static_priority == PRIORITY_IDLE) return false;
+
+    uint32_t irq;
+    cpu_t *cpu = task_rq_lock(proc, &irq);
+    proc->static_priority = priority;
+    if (proc->state == PROCESS_READY) {
+        rq_dequeue(cpu, proc);
+        rq_enqueue(cpu, proc);
+    } else {
+        proc->priority = effective_priority(proc);
+    }
+    spin_unlock_irqrestore(&cpu->lock, irq);
+    return true;
+}
+
+process_t *sched_pick_next(void) {
+    run_queue_t *rq = &this_cpu()->run_queue;
+    if (!rq->bitmap) return NULL;
+    return rq->levels[__builtin_ctz(rq->bitmap)].head;
+}
+
+// Best task on the busiest other queue, taken off it and moved to `cpu`.
+// Tasks still on their old CPU's stack, and pinned ones, stay where they
+// are. A contended queue is skipped rather than waited for.
+static process_t *steal_task(cpu_t *cpu) {
+    cpu_t *busiest = NULL;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_t *other = &cpus[i];
+        if (other == cpu || !other->online || !other->run_queue.nr_ready) continue;
+        if (!busiest || other->run_queue.nr_ready > busiest->run_queue.nr_ready) {
+            busiest = other;
+        }
+    }
+    if (!busiest || !spin_trylock(&busiest->lock)) return NULL;
+
+    process_t *found = NULL;
+    uint32_t bitmap = busiest->run_queue.bitmap;
+    while (bitmap && !found) {
+        uint32_t level = __builtin_ctz(bitmap);
+        bitmap &= bitmap - 1;
+        for (process_t *proc = busiest->run_queue.levels[level].head; proc; proc = proc->run_next) {
+            if (!proc->on_cpu && !proc->pinned) {
+                found = proc;
+                break;
+            }
+        }
+    }
+    if (found) {
+        rq_dequeue(busiest, found);
+        account_wait(found);
+        found->state = PROCESS_RUNNING;
+        found->cpu = cpu->id;
+        cpu->stats.steals++;
+    }
+    spin_unlock(&busiest->lock);
+    return found;
+}
+
+process_t *sched_next_task(process_t *prev) {
+    cpu_t *cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    cpu->need_resched = false;
+
+    bool runnable = prev->state == PROCESS_RUNNING;
+    process_t *next = sched_pick_next();
+    if (next && runnable && next->priority > prev->priority) {
+        next = NULL;
+    }
+    if (next) {
+        rq_dequeue(cpu, next);
+        account_wait(next);
+        next->state = PROCESS_RUNNING;
+    } else if ((!runnable || prev == cpu->idle) && cpu_count > 1) {
+        next = steal_task(cpu);
+    }
+
+    if (!next) {
+        if (runnable) {
+            if (prev->time_slice == 0) prev->time_slice = SCHED_TIME_SLICE;
+            spin_unlock(&cpu->lock);
+            return NULL;
+        }
+        next = cpu->idle;
+        next->state = PROCESS_RUNNING;
+    }
+    account_run(cpu, prev, rdtsc());
+    if (runnable) {
+        set_state_locked(cpu, prev, PROCESS_READY);
+        if (prev != cpu->idle) cpu->stats.preemptions++;
+        prev->nivcsw++;
+    } else {
+        prev->nvcsw++;
+    }
+    next->time_slice = SCHED_TIME_SLICE;
+    spin_unlock(&cpu->lock);
+    return next;
+}
+
+void sched_finish_switch(void) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->prev) {
+        cpu->prev->on_cpu = false;
+        cpu->prev = NULL;
+    }
+}
+
+// Whether another CPU has tasks waiting that this one could take
+static bool others_ready(cpu_t *cpu) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (&cpus[i] != cpu && cpus[i].run_queue.nr_ready) return true;
+    }
+    return false;
+}
+
+void sched_tick(void) {
+    cpu_t *cpu = this_cpu();
+    process_t *proc = cpu->current;
+    if (!proc) return;
+
+    account_run(cpu, proc, rdtsc());
+    proc->time_used++;
+    if (cpu->irq_from_user) proc->utime++;
+    else proc->stime++;
+    if (proc == cpu->idle) {
+        // Look for work to steal once a tick, in case no wakeup kicked us
+        if (cpu_count > 1 && others_ready(cpu)) cpu->need_resched = true;
+        return;
+    }
+    if (proc->sleep_avg) proc->sleep_avg--;
+    if (proc->time_slice && --proc->time_slice == 0) {
+        cpu->need_resched = true;
+    }
+}
+
+uint32_t sched_nr_active(void) {
+    uint32_t active = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (!cpu->online) continue;
+        active += cpu->run_queue.nr_ready;
+        if (cpu->current && cpu->current != cpu->idle) active++;
+    }
+    return active;
+}
+
+static uint32_t calc_load(uint32_t load, uint32_t exp, uint32_t active) {
+    return (load * exp + active * (FIXED_1 - exp)) >> FSHIFT;
+}
+
+void sched_calc_load(uint32_t tick) {
+    if (tick % LOAD_FREQ) return;
+    uint32_t active = sched_nr_active() * FIXED_1;
+    sched_loadavg[0] = calc_load(sched_loadavg[0], EXP_1, active);
+    sched_loadavg[1] = calc_load(sched_loadavg[1], EXP_5, active);
+    sched_loadavg[2] = calc_load(sched_loadavg[2], EXP_15, active);
+}
+
+void sched_block(spinlock_t *held) {
+    process_t *proc = current_process;
+    proc->sleep_start = get_tick_count();
+    sched_set_state(proc, PROCESS_BLOCKED);
+    if (held) spin_unlock(held);
+    schedule();
+}
+
+void sched_wakeup(process_t *proc) {
+    uint32_t irq;
+    cpu_t *cpu = task_rq_lock(proc, &irq);
+    if (proc->state == PROCESS_BLOCKED) {
+        // Credit the time asleep before the task is queued at its new level
+        uint32_t slept = get_tick_count() - proc->sleep_start;
+        proc->sleep_avg = proc->sleep_avg + slept < SLEEP_AVG_MAX ?
+                          proc->sleep_avg + slept : SLEEP_AVG_MAX;
+        proc->wake_tsc = rdtsc();
+        set_state_locked(cpu, proc, PROCESS_READY);
+        cpu->stats.wakeups++;
+    }
+    spin_unlock_irqrestore(&cpu->lock, irq);
+}
+
+void sched_wait_interrupt(void) {
+    uint32_t seen = irq_count;
+    wait_event(&irq_wait, irq_count != seen);
+}
+
+void sched_irq_return(void) {
+    irq_exit();
+    __sync_fetch_and_add(&irq_count, 1);
+    wake_up(&irq_wait);
+    cpu_t *cpu = this_cpu();
+    if (cpu->need_resched && cpu->preempt_count == 0) {
+        schedule();
+    }
+}
+
+void sched_stats_total(sched_stats_t *total) {
+    total->switches = total->preemptions = total->wakeups = total->steals = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        total->switches += cpus[i].stats.switches;
+        total->preemptions += cpus[i].stats.preemptions;
+        total->wakeups += cpus[i].stats.wakeups;
+        total->steals += cpus[i].stats.steals;
+    }
+}
+
+// The count is per CPU, but the task can't move while it's raised
+void preempt_disable(void) {
+    uint32_t irq = irq_save();
+    this_cpu()->preempt_count++;
+    irq_restore(irq);
+}
+
+// A reschedule that came due inside the section happens now, unless the
+// caller is also holding interrupts off
+void preempt_enable(void) {
+    uint32_t irq = irq_save();
+    cpu_t *cpu = this_cpu();
+    bool due = --cpu->preempt_count == 0 && cpu->need_resched;
+    irq_restore(irq);
+    if (due && (irq & EFLAGS_IF)) {
+        schedule();
+    }
+}
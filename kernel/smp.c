@@ -0,0 +1,516 @@
+#include "smp.h"
+#include "sched.h"
+#include "process.h"
+#include "kernel.h"
+#include "clock.h"
+#include "timer.h"
+#include "fpu.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "interrupts/idt.h"
+#include "memory/paging.h"
+#include <string.h>
+#include <stddef.h>
+
+// Multiprocessor bring-up. The firmware's ACPI MADT (or, failing that, the
+// older MP configuration table) lists each processor's local APIC. The boot
+// CPU wakes the others one at a time with INIT, STARTUP, STARTUP; each one
+// starts in real mode at AP_TRAMPOLINE, switches itself to protected mode
+// and paging with the boot CPU's settings and ends up in ap_main on the
+// stack of its own idle task.
+//
+// Per-CPU data is reached through %fs, which holds a data segment based at
+// that CPU's cpus[] entry. Interrupt entry leaves %fs alone, so a single
+// %fs-relative load reads the running CPU's fields.
+//
+// Only the boot CPU takes PIT and keyboard interrupts and runs the timer
+// wheel; the others get a periodic local APIC timer for their time slices.
+
+smp_stats_t smp_stats;
+volatile uint32_t *lapic = NULL;
+
+// Null, flat code and flat data, then one per-CPU data segment each
+#define GDT_PERCPU  3
+#define GDT_ENTRIES (GDT_PERCPU + MAX_CPUS)
+
+static uint64_t gdt[GDT_ENTRIES];
+static struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdt_ptr;
+
+// Local APIC timer counts per tick, at a divide of 16
+static uint32_t lapic_timer_counts = 0;
+
+// Kernel range every other CPU must flush, and the CPUs yet to do it
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static volatile uint32_t shootdown_start, shootdown_end;
+static volatile uint32_t shootdown_pending = 0;
+
+// What the trampoline loads before entering ap_main, patched in by the
+// boot CPU and kept at the end of the copied code
+typedef struct {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint16_t fs;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+} __attribute__((packed)) ap_boot_t;
+
+extern const uint8_t ap_trampoline_start[];
+extern const uint8_t ap_trampoline_end[];
+extern const uint8_t ap_boot_data[];
+
+// Address of a trampoline label once copied to AP_TRAMPOLINE
+#define TRAMPOLINE_BASE "0x9E000"
+#define AP_ADDR(label) "(" TRAMPOLINE_BASE " + " #label " - ap_trampoline_start)"
+
+// Copied to AP_TRAMPOLINE, so everything it touches is addressed relative
+// to that and the jump into the kernel is indirect. A STARTUP IPI enters it
+// in real mode with CS:IP = 0x9E00:0000.
+asm(
+    ".code16\n"
+    ".global ap_trampoline_start\n"
+    "ap_trampoline_start:\n"
+    "    cli\n"
+    "    cld\n"
+    "    mov %cs, %ax\n"
+    "    mov %ax, %ds\n"
+    "    lgdtl ap_boot_data - ap_trampoline_start\n"
+    "    mov %cr0, %eax\n"
+    "    or $1, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    ljmpl $0x08, $" AP_ADDR(ap_protected) "\n"
+    ".code32\n"
+    "ap_protected:\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %gs\n"
+    "    mov %ax, %ss\n"
+    "    movw " AP_ADDR(ap_boot_data) " + 6, %ax\n"
+    "    mov %ax, %fs\n"
+    // Page size extensions and global pages before paging comes on
+    "    mov " AP_ADDR(ap_boot_data) " + 16, %eax\n"
+    "    mov %eax, %cr4\n"
+    "    mov " AP_ADDR(ap_boot_data) " + 12, %eax\n"
+    "    mov %eax, %cr3\n"
+    "    mov " AP_ADDR(ap_boot_data) " + 8, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    mov " AP_ADDR(ap_boot_data) " + 20, %esp\n"
+    "    xor %ebp, %ebp\n"
+    "    mov $ap_main, %eax\n"
+    "    jmp *%eax\n"
+    ".align 4\n"
+    ".global ap_boot_data\n"
+    "ap_boot_data:\n"
+    "    .skip 24\n"
+    ".global ap_trampoline_end\n"
+    "ap_trampoline_end:\n"
+);
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    return (uint64_t)(limit & 0xFFFF) |
+           (uint64_t)(base & 0xFFFFFF) << 16 |
+           (uint64_t)access << 40 |
+           (uint64_t)((limit >> 16) & 0xF) << 48 |
+           (uint64_t)(flags & 0xF) << 52 |
+           (uint64_t)(base >> 24) << 56;
+}
+
+static inline uint16_t percpu_selector(uint32_t id) {
+    return (GDT_PERCPU + id) * 8;
+}
+
+void percpu_init(void) {
+    gdt[1] = gdt_entry(0, 0xFFFFF, 0x9A, 0xC); // Ring 0 code, 4KB granular
+    gdt[2] = gdt_entry(0, 0xFFFFF, 0x92, 0xC); // Ring 0 data
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].self = &cpus[i];
+        cpus[i].id = i;
+        gdt[GDT_PERCPU + i] = gdt_entry((uint32_t)&cpus[i], sizeof(cpu_t) - 1, 0x92, 0x4);
+    }
+    gdt_ptr.limit = sizeof(gdt) - 1;
+    gdt_ptr.base = (uint32_t)gdt;
+
+    // The code and data selectors keep their meaning, so only %fs changes
+    asm volatile("lgdt %0" : : "m"(gdt_ptr));
+    asm volatile("mov %0, %%fs" : : "r"((uint32_t)percpu_selector(0)) : "memory");
+    cpus[0].online = true;
+}
+
+static bool checksum_ok(const void *table, uint32_t length) {
+    const uint8_t *bytes = (const uint8_t*)table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// Firmware tables can sit in reserved memory past the identity map of RAM
+static const void *phys_map(uint32_t addr, uint32_t length) {
+    for (uint32_t page = addr & ~(PAGE_SIZE - 1); page < addr + length; page += PAGE_SIZE) {
+        if (get_physical_address(page) != page) {
+            map_page(page, page, PAGE_PRESENT);
+        }
+    }
+    return (const void*)addr;
+}
+
+// A checksummed structure starting with `signature` on a 16-byte boundary
+static const void *scan(uint32_t start, uint32_t length, const char *signature, uint32_t checked) {
+    for (uint32_t addr = start; addr + checked <= start + length; addr += 16) {
+        if (memcmp((const void*)addr, signature, strlen(signature)) == 0 &&
+            checksum_ok((const void*)addr, checked)) {
+            return (const void*)addr;
+        }
+    }
+    return NULL;
+}
+
+// The first KB of the EBDA, then the BIOS ROM
+static const void *scan_bios(const char *signature, uint32_t checked) {
+    // The BIOS data area keeps the EBDA's segment at 0x40E
+    uint16_t segment;
+    memcpy(&segment, (const void*)0x40E, sizeof(segment));
+    uint32_t ebda = (uint32_t)segment << 4;
+    const void *found = ebda ? scan(ebda, 1024, signature, checked) : NULL;
+    if (!found) found = scan(0x9FC00, 1024, signature, checked);
+    if (!found) found = scan(0xE0000, 0x20000, signature, checked);
+    return found;
+}
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_base;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_LOCAL_APIC    0
+#define MADT_CPU_ENABLED   0x01
+
+static const acpi_header_t *acpi_table(uint32_t addr) {
+    const acpi_header_t *header = (const acpi_header_t*)phys_map(addr, sizeof(acpi_header_t));
+    phys_map(addr, header->length);
+    return checksum_ok(header, header->length) ? header : NULL;
+}
+
+// Local APIC IDs of the enabled processors in the MADT
+static uint32_t madt_find_cpus(uint8_t *apic_ids, uint32_t *lapic_base) {
+    const acpi_rsdp_t *rsdp = (const acpi_rsdp_t*)scan_bios("RSD PTR ", 20);
+    if (!rsdp) return 0;
+
+    const acpi_header_t *rsdt = acpi_table(rsdp->rsdt);
+    if (!rsdt) return 0;
+
+    const uint32_t *entries = (const uint32_t*)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < count; i++) {
+        const acpi_header_t *table = acpi_table(entries[i]);
+        if (!table || memcmp(table->signature, "APIC", 4) != 0) continue;
+
+        const acpi_madt_t *madt = (const acpi_madt_t*)table;
+        *lapic_base = madt->lapic_base;
+        uint32_t found = 0;
+        const uint8_t *entry = (const uint8_t*)(madt + 1);
+        const uint8_t *end = (const uint8_t*)madt + madt->header.length;
+        while (entry + 2 <= end && entry[1] >= 2) {
+            if (entry[0] == MADT_LOCAL_APIC && (entry[4] & MADT_CPU_ENABLED) &&
+                found < MAX_CPUS) {
+                apic_ids[found++] = entry[3];
+            }
+            entry += entry[1];
+        }
+        return found;
+    }
+    return 0;
+}
+
+typedef struct {
+    char signature[4];
+    uint32_t config;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct {
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_base;
+    uint16_t extended_length;
+    uint8_t extended_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+#define MP_PROCESSOR       0
+#define MP_CPU_ENABLED     0x01
+
+// The same from the MP specification's table, for firmware without ACPI
+static uint32_t mp_find_cpus(uint8_t *apic_ids, uint32_t *lapic_base) {
+    const mp_floating_t *mpf = (const mp_floating_t*)scan_bios("_MP_", 16);
+    if (!mpf || !mpf->config) return 0;
+
+    const mp_config_t *config = (const mp_config_t*)phys_map(mpf->config, sizeof(mp_config_t));
+    phys_map(mpf->config, config->length);
+    if (memcmp(config->signature, "PCMP", 4) != 0 || !checksum_ok(config, config->length)) {
+        return 0;
+    }
+
+    *lapic_base = config->lapic_base;
+    uint32_t found = 0;
+    const uint8_t *entry = (const uint8_t*)(config + 1);
+    for (uint32_t i = 0; i < config->entry_count; i++) {
+        if (entry[0] == MP_PROCESSOR) {
+            if ((entry[3] & MP_CPU_ENABLED) && found < MAX_CPUS) {
+                apic_ids[found++] = entry[1];
+            }
+            entry += 20;
+        } else {
+            entry += 8;
+        }
+    }
+    return found;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// The ICR is two registers, so nothing on this CPU may send in between
+static void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    uint32_t irq = irq_save();
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+        cpu_relax();
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    smp_stats.ipis_sent++;
+    irq_restore(irq);
+}
+
+// The boot CPU's LINT0 stays as the firmware left it, carrying the PIC's
+// interrupts; on the others it has nothing to deliver
+static void lapic_enable(bool boot_cpu) {
+    lapic_write(LAPIC_TPR, 0);
+    if (!boot_cpu) {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    }
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | VECTOR_SPURIOUS);
+    lapic_eoi();
+}
+
+// Count the timer down for a known time; every CPU's runs off the same bus
+// clock, so the boot CPU measures once for all of them
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    udelay(1000000 / TIMER_HZ);
+    lapic_timer_counts = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | VECTOR_LAPIC_TIMER);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_counts);
+}
+
+void lapic_timer_handler(void) {
+    sched_tick();
+}
+
+static void shootdown_flush(uint32_t bit) {
+    tlb_flush_range(shootdown_start, shootdown_end);
+    __sync_fetch_and_and(&shootdown_pending, ~bit);
+}
+
+void tlb_shootdown_handler(void) {
+    uint32_t bit = 1u << smp_processor_id();
+    if (shootdown_pending & bit) {
+        shootdown_flush(bit);
+    }
+}
+
+void smp_poll(void) {
+    if (!shootdown_pending) return;
+    tlb_shootdown_handler();
+}
+
+void smp_send_reschedule(uint32_t cpu) {
+    lapic_send_ipi(cpus[cpu].apic_id, VECTOR_RESCHEDULE);
+}
+
+void tlb_shootdown(uint32_t start, uint32_t end) {
+    if (cpu_count < 2) return;
+
+    uint32_t irq = spin_lock_irqsave(&shootdown_lock);
+    uint32_t self = smp_processor_id();
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].online) targets |= 1u << i;
+    }
+    if (targets) {
+        shootdown_start = start;
+        shootdown_end = end;
+        shootdown_pending = targets;
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            if (targets & (1u << i)) {
+                lapic_send_ipi(cpus[i].apic_id, VECTOR_TLB_SHOOTDOWN);
+                smp_stats.shootdown_ipis++;
+            }
+        }
+        while (shootdown_pending) {
+            cpu_relax();
+        }
+        smp_stats.shootdowns++;
+    }
+    spin_unlock_irqrestore(&shootdown_lock, irq);
+}
+
+// An AP's first C code, on its idle task's stack with %fs already pointing
+// at its cpus[] entry
+void ap_main(void) {
+    cpu_t *cpu = this_cpu();
+    load_idt();
+    fpu_init();
+    lapic_enable(false);
+    lapic_timer_start();
+    cpu->online = true;
+
+    asm volatile("sti");
+    for (;;) {
+        kernel_idle();
+    }
+}
+
+// INIT, then two STARTUPs as the MP specification asks; most CPUs are up
+// after the first
+static bool start_ap(cpu_t *cpu) {
+    lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+    udelay(10000);
+    lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_LEVEL);
+
+    for (uint32_t attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        udelay(200);
+    }
+    for (uint32_t waited = 0; waited < 100 && !cpu->online; waited++) {
+        udelay(1000);
+    }
+    return cpu->online;
+}
+
+void smp_init(void) {
+    if (!cpu_has_edx_feature(CPUID_EDX_APIC) || !cpu_has_edx_feature(CPUID_EDX_MSR) ||
+        !clock_has_tsc()) {
+        printf("SMP: no local APIC or TSC, running on one CPU\n");
+        return;
+    }
+
+    uint8_t apic_ids[MAX_CPUS];
+    uint32_t lapic_base = (uint32_t)rdmsr(MSR_APIC_BASE) & 0xFFFFF000;
+    uint32_t found = madt_find_cpus(apic_ids, &lapic_base);
+    if (!found) found = mp_find_cpus(apic_ids, &lapic_base);
+    smp_stats.cpus_found = found;
+
+    // Uncached, before any user directory copies the kernel's tables
+    map_page(lapic_base, lapic_base, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NOCACHE | PAGE_WRITETHROUGH);
+    lapic = (volatile uint32_t*)lapic_base;
+
+    extern void lapic_timer_handler_asm(void);
+    extern void reschedule_handler_asm(void);
+    extern void tlb_shootdown_handler_asm(void);
+    extern void spurious_handler_asm(void);
+    idt_set_gate(VECTOR_LAPIC_TIMER, (uint32_t)lapic_timer_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
+    idt_set_gate(VECTOR_RESCHEDULE, (uint32_t)reschedule_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
+    idt_set_gate(VECTOR_TLB_SHOOTDOWN, (uint32_t)tlb_shootdown_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
+    idt_set_gate(VECTOR_SPURIOUS, (uint32_t)spurious_handler_asm, 0x08, IDT_FLAG_PRESENT | IDT_GATE_INT32);
+
+    lapic_enable(true);
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    if (found < 2) {
+        printf("SMP: %u CPU listed, nothing to start\n", found ? found : 1);
+        return;
+    }
+    lapic_timer_calibrate();
+
+    // Every AP enters with the boot CPU's GDT and paging setup
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    ap_boot_t *boot = (ap_boot_t*)(AP_TRAMPOLINE + (ap_boot_data - ap_trampoline_start));
+    boot->gdt_limit = gdt_ptr.limit;
+    boot->gdt_base = gdt_ptr.base;
+    boot->cr0 = read_cr0();
+    boot->cr3 = page_directory_phys(kernel_directory);
+    boot->cr4 = read_cr4();
+
+    for (uint32_t i = 0; i < found && cpu_count < MAX_CPUS; i++) {
+        if (apic_ids[i] == cpus[0].apic_id) continue;
+
+        cpu_t *cpu = &cpus[cpu_count];
+        process_t *idle = create_process("idle", NULL, true);
+        if (!idle) break;
+        cpu->apic_id = apic_ids[i];
+        sched_init_cpu(cpu, idle);
+        boot->fs = percpu_selector(cpu->id);
+        boot->stack = idle->kernel_stack;
+
+        cpu_count++;
+        if (!start_ap(cpu)) {
+            printf("SMP: CPU with APIC ID %u did not start\n", cpu->apic_id);
+            cpu_count--;
+            cpu->idle = cpu->current = NULL;
+            idle->on_cpu = false;
+            destroy_process(idle);
+        }
+    }
+    printf("SMP: %u of %u CPUs online, local APIC at 0x%x\n", cpu_count, found, lapic_base);
+}
+
+void smp_report(void) {
+    printf("cpu\tapic\tready\tswitch\tpreempt\twakeup\tsteal\trunning\n");
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (!cpu->online) continue;
+        process_t *running = cpu->current;
+        printf("%u\t%u\t%u\t%u\t%u\t%u\t%u\t%s\n", cpu->id, cpu->apic_id,
+               cpu->run_queue.nr_ready, cpu->stats.switches, cpu->stats.preemptions,
+               cpu->stats.wakeups, cpu->stats.steals, running ? running->name : "-");
+    }
+    printf("IPIs sent %u, TLB shootdowns %u (%u IPIs)\n",
+           smp_stats.ipis_sent, smp_stats.shootdowns, smp_stats.shootdown_ipis);
+}
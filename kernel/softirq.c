@@ -0,0 +1,118 @@
+#include "softirq.h"
+#include "sched.h"
+#include "clock.h"
+#include "cpu.h"
+#include "kernel.h"
+#include <stddef.h>
+
+softirq_stats_t softirq_stats;
+
+static void (*softirq_handlers[NR_SOFTIRQS])(void);
+static const char *softirq_names[NR_SOFTIRQS] = { "timer", "keyboard" };
+static bool deferred = true;
+
+void open_softirq(uint32_t nr, void (*handler)(void)) {
+    softirq_handlers[nr] = handler;
+}
+
+void raise_softirq(uint32_t nr) {
+    uint32_t irq = irq_save();
+    this_cpu()->softirq_pending |= 1u << nr;
+    softirq_stats.raised[nr]++;
+    irq_restore(irq);
+}
+
+bool softirq_pending(void) {
+    return this_cpu()->softirq_pending != 0;
+}
+
+// Raising preempt_count keeps interrupts taken meanwhile from switching
+// tasks on their way out, so the handlers finish on this CPU and stack
+void do_softirq(void) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->in_softirq || !cpu->softirq_pending) return;
+    cpu->in_softirq = true;
+    cpu->preempt_count++;
+
+    uint64_t start = rdtsc();
+    for (uint32_t pass = 0; cpu->softirq_pending && pass < SOFTIRQ_RESTART_MAX; pass++) {
+        uint32_t pending = cpu->softirq_pending;
+        cpu->softirq_pending = 0;
+        if (deferred) asm volatile("sti" : : : "memory");
+        while (pending) {
+            uint32_t nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            softirq_stats.runs[nr]++;
+            if (softirq_handlers[nr]) softirq_handlers[nr]();
+        }
+        asm volatile("cli" : : : "memory");
+    }
+    if (cpu->softirq_pending) softirq_stats.postponed++;
+
+    uint64_t cycles = rdtsc() - start;
+    if (cycles > softirq_stats.softirq_max) softirq_stats.softirq_max = cycles;
+    cpu->preempt_count--;
+    cpu->in_softirq = false;
+}
+
+void irq_enter(interrupt_frame_t *frame) {
+    cpu_t *cpu = this_cpu();
+    cpu->irq_start = rdtsc();
+    cpu->irq_from_user = (frame->cs & 3) == 3;
+}
+
+// Called before the interrupt return path may switch tasks. When bottom
+// halves aren't deferred they count towards the top half, as they did
+// when handlers did all their work there.
+//
+// The whole interrupt, bottom halves included, is charged as IRQ time to
+// the task it interrupted. One taken while softirqs run is already inside
+// the outer interrupt's time.
+void irq_exit(void) {
+    cpu_t *cpu = this_cpu();
+    uint64_t start = cpu->irq_start;
+    bool nested = cpu->in_softirq;
+    if (!deferred) do_softirq();
+
+    uint64_t cycles = rdtsc() - start;
+    if (cycles > softirq_stats.irq_off_max) softirq_stats.irq_off_max = cycles;
+    do_softirq();
+
+    if (!nested) {
+        cycles = rdtsc() - start;
+        cpu->irq_cycles += cycles;
+        if (cpu->current) cpu->current->irq_cycles += cycles;
+    }
+}
+
+void softirq_set_deferred(bool enabled) {
+    deferred = enabled;
+}
+
+bool softirq_deferred(void) {
+    return deferred;
+}
+
+void softirq_reset_max(void) {
+    softirq_stats.irq_off_max = 0;
+    softirq_stats.softirq_max = 0;
+}
+
+static uint32_t cycles_to_us(uint64_t cycles) {
+    return (uint32_t)div_u64(cycles_to_ns(cycles), NSEC_PER_USEC, NULL);
+}
+
+void softirq_report(void) {
+    softirq_stats_t s = softirq_stats;
+
+    printf("Bottom halves %s\n", deferred ? "deferred" : "run in the top half");
+    printf("softirq\t\traised\truns\n");
+    for (uint32_t nr = 0; nr < NR_SOFTIRQS; nr++) {
+        printf("%s\t\t%u\t%u\n", softirq_names[nr], s.raised[nr], s.runs[nr]);
+    }
+    printf("postponed passes %u\n", s.postponed);
+    printf("worst interrupts-off top half: %u cycles (%u us)\n",
+           (uint32_t)s.irq_off_max, cycles_to_us(s.irq_off_max));
+    printf("longest softirq run: %u cycles (%u us)\n",
+           (uint32_t)s.softirq_max, cycles_to_us(s.softirq_max));
+}
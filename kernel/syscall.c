@@ -1,21 +1,60 @@
 #include <stdint.h>
 #include "kernel.h"
+#include "syscall.h"
+#include "process.h"
+#include "sched.h"
+#include "clock.h"
+#include "memory/paging.h"
 #include "interrupts/idt.h"
+#include <stddef.h>
 
-// System call numbers
-#define SYS_EXIT    1
-#define SYS_FORK    2
-#define SYS_READ    3
-#define SYS_WRITE   4
-#define SYS_OPEN    5
-#define SYS_CLOSE   6
-#define SYS_WAITPID 7
-#define SYS_CREAT   8
-#define SYS_LINK    9
-#define SYS_UNLINK  10
+uint32_t sys_brk(uint32_t addr) {
+    return process_brk(current_process, addr);
+}
+
+// pid 0 means the caller. Both return -1 for an unknown process, and
+// setting also fails for a level outside the run queue.
+uint32_t sys_getpriority(uint32_t pid) {
+    process_t *proc = pid ? find_process(pid) : current_process;
+    return proc ? proc->static_priority : (uint32_t)-1;
+}
+
+uint32_t sys_setpriority(uint32_t pid, uint32_t priority) {
+    process_t *proc = pid ? find_process(pid) : current_process;
+    if (!proc || !sched_set_priority(proc, priority)) return (uint32_t)-1;
+    return 0;
+}
+
+// True if [addr, addr + size) lies in user space and every page of it is
+// mapped for user access in the caller's address space
+static bool user_range_mapped(uint32_t addr, uint32_t size) {
+    if (addr < USER_SPACE_START || addr > USER_SPACE_END - size) return false;
+
+    for (uint32_t page = addr & ~(PAGE_SIZE - 1); page < addr + size; page += PAGE_SIZE) {
+        uint32_t *entry = get_page(page, false, current_directory);
+        if (!entry || (*entry & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Nanoseconds since boot, stored as 64 bits at ns_out since EAX can't hold
+// them; returns whole seconds, or -1 if ns_out isn't mapped user memory
+uint32_t sys_time(uint32_t ns_out) {
+    if (ns_out && !user_range_mapped(ns_out, sizeof(uint64_t))) return (uint32_t)-1;
 
-// System call handler
-void syscall_handler(uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx) {
+    uint64_t ns = clock_ns();
+    if (ns_out) *(uint64_t*)ns_out = ns;
+    return (uint32_t)div_u64(ns, NSEC_PER_SEC, NULL);
+}
+
+uint32_t sys_alarm(uint32_t seconds) {
+    return process_alarm(current_process, seconds);
+}
+
+// System call handler; the return value is handed back to the caller in EAX
+uint32_t syscall_handler(uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx) {
     switch (eax) {
         case SYS_EXIT:
             // Handle exit system call
@@ -43,10 +82,26 @@ void syscall_handler(uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx) {
             }
             break;
             
+        case SYS_TIME:
+            return sys_time(ebx);
+            
+        case SYS_ALARM:
+            return sys_alarm(ebx);
+            
+        case SYS_BRK:
+            return sys_brk(ebx);
+            
+        case SYS_GETPRIORITY:
+            return sys_getpriority(ebx);
+            
+        case SYS_SETPRIORITY:
+            return sys_setpriority(ebx, ecx);
+            
         default:
             printf("Unknown system call: %d\n", eax);
             break;
     }
+    return 0;
 }
 
 // Assembly syscall handler wrapper
@@ -66,13 +121,12 @@ asm(
     "    pusha\n"
     "    push %ds\n"
     "    push %es\n"
-    "    push %fs\n"
     "    push %gs\n"
     "    \n"
-    "    mov $0x10, %ax\n"  // Load kernel data segment
+    "    cld\n"
+    "    mov $0x10, %ax\n"  // Load kernel data segment; %fs is per CPU
     "    mov %ax, %ds\n"
     "    mov %ax, %es\n"
-    "    mov %ax, %fs\n"
     "    mov %ax, %gs\n"
     "    \n"
     "    push %edx\n"       // 4th parameter
@@ -81,9 +135,9 @@ asm(
     "    push %eax\n"       // 1st parameter (syscall number)
     "    call syscall_handler\n"
     "    add $16, %esp\n"   // Clean up parameters
+    "    mov %eax, 40(%esp)\n" // Return value into the saved EAX
     "    \n"
     "    pop %gs\n"
-    "    pop %fs\n"
     "    pop %es\n"
     "    pop %ds\n"
     "    popa\n"
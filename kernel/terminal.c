@@ -1,5 +1,6 @@
 #include "terminal.h"
 #include "kernel.h"
+#include "drivers/keyboard.h"
 
 terminal_t main_terminal;
 
@@ -48,9 +49,7 @@ void terminal_get_line(char *buffer, int max_length) {
     char c;
     
     while (pos < max_length - 1) {
-        while ((c = terminal_getchar()) == 0) {
-            asm volatile("hlt");
-        }
+        c = keyboard_read_char();
         
         if (c == '\n' || c == '\r') {
             buffer[pos] = '\0';
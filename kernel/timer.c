@@ -1,42 +1,179 @@
 #include "timer.h"
+#include "sched.h"
+#include "clock.h"
+#include "ktimer.h"
+#include "softirq.h"
+#include "wait.h"
+#include "kernel.h"
+#include "cpu.h"
 #include "io.h"
+#include <stddef.h>
+
+#define PIT_CH0_DATA     0x40
+#define PIT_COMMAND      0x43
+#define PIT_CH0_PERIODIC 0x34 // Channel 0, low then high byte, mode 2
+#define PIT_CH0_ONESHOT  0x30 // Channel 0, low then high byte, mode 0
+#define PIT_CH0_READBACK 0xC2 // Latch channel 0's status and count
+#define PIT_STATUS_OUT   0x80
+
+timer_stats_t timer_stats;
 
 static volatile uint32_t tick_count = 0;
+static uint32_t tick_divisor = 0;       // PIT counts per periodic tick
+static uint32_t pending_counts = 0;     // Counts short of a whole tick
+static bool tickless = true;
+static bool idle = false;               // Halted in timer_idle_enter
+static uint64_t idle_start = 0;
+static uint32_t oneshot_counts = 0;     // Non-zero while the tick is stopped
+static bool skip_tick = false;          // The next IRQ 0 was already counted
+static bool irq_from_idle = false;      // The interrupt being handled ended a halt
 
+static void pit_program(uint8_t mode, uint32_t count) {
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CH0_DATA, (uint8_t)(count & 0xFF));
+    outb(PIT_CH0_DATA, (uint8_t)((count >> 8) & 0xFF));
+}
+
+// Returns the counter, and in *expired whether the output pin is high
+static uint32_t pit_read(bool *expired) {
+    outb(PIT_COMMAND, PIT_CH0_READBACK);
+    uint8_t status = inb(PIT_CH0_DATA);
+    uint32_t count = inb(PIT_CH0_DATA);
+    count |= (uint32_t)inb(PIT_CH0_DATA) << 8;
+    if (expired) *expired = (status & PIT_STATUS_OUT) != 0;
+    return count;
+}
+
+// Expired timers fire in the bottom half, with interrupts on
+static void timer_softirq(void) {
+    ktimer_run(tick_count);
+}
+
+// Mode 2 rather than a square wave, so the counter read back falls
+// steadily through each period
 void timer_init(uint32_t frequency) {
-    // Calculate divisor for desired frequency
-    uint32_t divisor = PIT_FREQUENCY / frequency;
-    
-    // Send command byte
-    outb(0x43, 0x36);
-    
-    // Send frequency divisor
-    uint8_t low = (uint8_t)(divisor & 0xFF);
-    uint8_t high = (uint8_t)((divisor >> 8) & 0xFF);
-    
-    outb(0x40, low);
-    outb(0x40, high);
+    tick_divisor = PIT_FREQUENCY / frequency;
+    open_softirq(SOFTIRQ_TIMER, timer_softirq);
+    pit_program(PIT_CH0_PERIODIC, tick_divisor);
 }
 
-void timer_handler(void) {
+static void timer_tick(void) {
     tick_count++;
-    
-    // Schedule next task if multitasking is enabled
-    // schedule_next_task();
-    
-    // Send EOI to PIC
-    outb(0x20, 0x20);
+    sched_tick();
+    sched_calc_load(tick_count);
+    raise_softirq(SOFTIRQ_TIMER);
+}
+
+// Turn PIT counts that passed without interrupts into ticks
+static void timer_catch_up(uint32_t counts) {
+    pending_counts += counts;
+    while (pending_counts >= tick_divisor) {
+        pending_counts -= tick_divisor;
+        timer_stats.caught_up++;
+        timer_tick();
+    }
+}
+
+// The common IRQ stub sends the EOI and switches tasks if the tick ended
+// the running task's slice
+void timer_handler(void) {
+    if (skip_tick) {
+        skip_tick = false;
+        return;
+    }
+    if (!irq_from_idle) timer_stats.busy_ticks++;
+    timer_tick();
 }
 
 uint32_t get_tick_count(void) {
     return tick_count;
 }
 
+static void sleep_timeout(ktimer_t *timer) {
+    wake_up((wait_queue_t*)timer->data);
+}
+
+// Block for at least the given time. The current tick is already partly
+// over, so the wait is rounded up and one more tick added.
 void sleep(uint32_t milliseconds) {
-    uint32_t start_ticks = tick_count;
-    uint32_t target_ticks = start_ticks + (milliseconds / 10); // Assuming 100Hz timer
-    
-    while (tick_count < target_ticks) {
-        asm volatile("hlt"); // Halt until next interrupt
+    uint32_t ticks = (milliseconds * TIMER_HZ + 999) / 1000 + 1;
+    wait_queue_t wq = WAIT_QUEUE_INIT;
+    ktimer_t timer;
+
+    ktimer_init(&timer, sleep_timeout, &wq);
+    ktimer_add(&timer, tick_count + ticks);
+    wait_event(&wq, !ktimer_pending(&timer));
+
+    // The callback runs on the boot CPU and may still be waking wq
+    ktimer_cancel(&timer);
+}
+
+// Called by the idle task with interrupts off, just before it halts. The
+// PIT belongs to the boot CPU; the others halt with their local APIC
+// timers still running.
+void timer_idle_enter(void) {
+    if (smp_processor_id() != 0) return;
+    idle = true;
+    idle_start = clock_ns();
+    if (!tickless || !tick_divisor) return;
+
+    // Not worth stopping the tick if a timer is due on the next one
+    uint32_t ticks = ktimer_idle_ticks(tick_count, PIT_ONESHOT_MAX / tick_divisor);
+    if (ticks <= 1) {
+        ktimer_idle_exit();
+        return;
     }
+
+    // Count from the last tick, including any part of a period carried
+    // over; the counts are only turned into ticks on wakeup, so no timer
+    // can fire before the halt
+    uint32_t left = pit_read(NULL);
+    uint32_t elapsed = left < tick_divisor ? tick_divisor - left : 0;
+    pending_counts += elapsed;
+    uint32_t counts = ticks * tick_divisor - pending_counts;
+
+    pit_program(PIT_CH0_ONESHOT, counts);
+    oneshot_counts = counts;
+    timer_stats.oneshots++;
+}
+
+// First thing on every hardware interrupt. Going back to periodic mode
+// raises the PIT output if the one-shot hadn't, so exactly one IRQ 0 is
+// owed for the stopped period: this one, or one that is now pending.
+void timer_irq_enter(void) {
+    if (smp_processor_id() != 0) return;
+    irq_from_idle = idle;
+    if (!idle) return;
+    idle = false;
+    timer_stats.idle_wakeups++;
+    timer_stats.idle_ns += clock_ns() - idle_start;
+
+    if (oneshot_counts) {
+        ktimer_idle_exit();
+        bool expired;
+        uint32_t left = pit_read(&expired);
+        pit_program(PIT_CH0_PERIODIC, tick_divisor);
+        timer_catch_up(expired || left > oneshot_counts ? oneshot_counts : oneshot_counts - left);
+        oneshot_counts = 0;
+        skip_tick = true;
+    }
+}
+
+void timer_set_tickless(bool enabled) {
+    tickless = enabled;
+}
+
+void timer_report(void) {
+    uint32_t total_ms = (uint32_t)div_u64(clock_ns(), NSEC_PER_MSEC, NULL);
+    uint32_t idle_ms = (uint32_t)div_u64(timer_stats.idle_ns, NSEC_PER_MSEC, NULL);
+    uint32_t busy_ms = total_ms > idle_ms ? total_ms - idle_ms : 0;
+
+    printf("Timer: %uHz tick, tickless idle %s\n", TIMER_HZ, tickless ? "on" : "off");
+    printf("state\tms\twakeups\tper second\n");
+    printf("idle\t%u\t%u\t%u\n", idle_ms, timer_stats.idle_wakeups,
+           idle_ms ? (uint32_t)div_u64((uint64_t)timer_stats.idle_wakeups * 1000, idle_ms, NULL) : 0);
+    printf("busy\t%u\t%u\t%u\n", busy_ms, timer_stats.busy_ticks,
+           busy_ms ? (uint32_t)div_u64((uint64_t)timer_stats.busy_ticks * 1000, busy_ms, NULL) : 0);
+    printf("one-shot halts %u, ticks caught up %u\n",
+           timer_stats.oneshots, timer_stats.caught_up);
 }
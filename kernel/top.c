@@ -0,0 +1,132 @@
+#include "top.h"
+#include "process.h"
+#include "sched.h"
+#include "clock.h"
+#include "timer.h"
+#include "kernel.h"
+#include "drivers/keyboard.h"
+#include <stddef.h>
+
+// Running, queued, sleeping, exited
+static const char state_letters[] = { 'R', 'Q', 'S', 'Z' };
+
+typedef struct {
+    const process_sample_t *sample;
+    uint32_t permille; // Of one CPU over the interval
+} top_row_t;
+
+static uint32_t cycles_to_ms(uint64_t cycles) {
+    return (uint32_t)div_u64(cycles_to_ns(cycles), NSEC_PER_MSEC, NULL);
+}
+
+// Fixed-point load average as x.yy
+static void print_load(uint32_t load) {
+    uint32_t hundredths = ((load & (FIXED_1 - 1)) * 100) >> FSHIFT;
+    printf("%u.%u%u", load >> FSHIFT, hundredths / 10, hundredths % 10);
+}
+
+static process_sample_t *take_snapshot(uint32_t *count) {
+    uint32_t max = process_snapshot(NULL, 0) + TOP_SLACK;
+    process_sample_t *samples = (process_sample_t*)kmalloc(max * sizeof(process_sample_t));
+    if (!samples) return NULL;
+    uint32_t total = process_snapshot(samples, max);
+    *count = total < max ? total : max;
+    return samples;
+}
+
+static const process_sample_t *find_sample(const process_sample_t *samples, uint32_t count,
+                                           uint32_t pid) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (samples[i].pid == pid) return &samples[i];
+    }
+    return NULL;
+}
+
+// Sleep out the interval in short steps, so a key ends it promptly.
+// Returns false if one was pressed.
+static bool wait_interval(void) {
+    for (uint32_t ms = 0; ms < TOP_INTERVAL_MS; ms += 100) {
+        if (keyboard_data_available()) {
+            keyboard_get_char();
+            return false;
+        }
+        sleep(100);
+    }
+    return true;
+}
+
+// Keep the TOP_ROWS busiest, busiest first
+static uint32_t insert_row(top_row_t *rows, uint32_t shown, top_row_t row) {
+    uint32_t i = shown < TOP_ROWS ? shown++ : TOP_ROWS;
+    while (i > 0 && rows[i - 1].permille < row.permille) {
+        if (i < TOP_ROWS) rows[i] = rows[i - 1];
+        i--;
+    }
+    if (i < TOP_ROWS) rows[i] = row;
+    return shown;
+}
+
+static void print_refresh(const process_sample_t *before, uint32_t before_count,
+                          const process_sample_t *after, uint32_t count, uint32_t elapsed_ns) {
+    top_row_t rows[TOP_ROWS];
+    uint32_t shown = 0;
+    uint32_t busy = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const process_sample_t *old = find_sample(before, before_count, after[i].pid);
+        uint64_t ran = after[i].run_cycles - (old ? old->run_cycles : 0);
+        uint32_t permille = (uint32_t)div_u64(cycles_to_ns(ran) * 1000, elapsed_ns, NULL);
+        if (permille > 1000) permille = 1000; // Charged up to a tick late
+        if (after[i].priority != PRIORITY_IDLE) busy += permille;
+        top_row_t row = { &after[i], permille };
+        shown = insert_row(rows, shown, row);
+    }
+    busy /= cpu_count;
+
+    clear_screen();
+    printf("top - up %u s, %u tasks, %u active, load average: ",
+           (uint32_t)div_u64(clock_ns(), NSEC_PER_SEC, NULL), count, sched_nr_active());
+    print_load(sched_loadavg[0]);
+    printf(", ");
+    print_load(sched_loadavg[1]);
+    printf(", ");
+    print_load(sched_loadavg[2]);
+    printf("\n%u CPUs, %u.%u%% busy; USR and SYS in ticks, IRQ and WAIT in ms\n",
+           cpu_count, busy / 10, busy % 10);
+    printf("PID\tNAME\t\tS\tCPU\tPRI\t%%CPU\tUSR\tSYS\tIRQ\tWAIT\tVCSW\tIVCSW\n");
+    for (uint32_t i = 0; i < shown; i++) {
+        const process_sample_t *s = rows[i].sample;
+        printf("%u\t%s\t\t%c\t%u\t%u\t%u.%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
+               s->pid, s->name, state_letters[s->state], s->cpu, s->priority,
+               rows[i].permille / 10, rows[i].permille % 10, s->utime, s->stime,
+               cycles_to_ms(s->irq_cycles), cycles_to_ms(s->wait_cycles), s->nvcsw, s->nivcsw);
+    }
+}
+
+void top_run(uint32_t refreshes) {
+    uint32_t before_count;
+    process_sample_t *before = take_snapshot(&before_count);
+    uint64_t before_ns = clock_ns();
+    if (!before) {
+        printf("top: out of memory\n");
+        return;
+    }
+
+    for (uint32_t n = 0; refreshes == 0 || n < refreshes; n++) {
+        bool more = wait_interval();
+        uint32_t count;
+        process_sample_t *after = take_snapshot(&count);
+        uint64_t now = clock_ns();
+        if (!after) break;
+
+        uint32_t elapsed_ns = (uint32_t)(now - before_ns);
+        if (elapsed_ns) {
+            print_refresh(before, before_count, after, count, elapsed_ns);
+        }
+        kfree(before);
+        before = after;
+        before_count = count;
+        before_ns = now;
+        if (!more) break;
+    }
+    kfree(before);
+}
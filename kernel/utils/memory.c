@@ -1,73 +1,652 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stddef.h>
+#include "memory/paging.h"
+#include "kernel.h"
+#include "spinlock.h"
 
-// A simple heap allocator
-static uint32_t heap_current = 0x300000; // Start at 3MB to avoid conflicts
-static uint32_t heap_end = 0x800000;     // End at 8MB
+// Kernel heap: a segregated free-list allocator.
+//
+// Every block starts with a 16-byte header holding its own size and the size
+// of the block physically before it, so neighbours can be found in O(1) for
+// coalescing, and, while the block is in use, the size requested and the
+// call site charged for it. Requests up to HEAP_SMALL_MAX bytes are rounded up to a
+// power-of-two size class and served from a per-class free list; freed small
+// blocks go straight back onto their list and are never coalesced. Anything
+// larger is carved first-fit from a doubly-linked list of free large blocks,
+// which are split on allocation and merged with free neighbours on release.
+// Small blocks are themselves carved from the large pool, so the region is
+// one contiguous chain of blocks ending in a zero-sized sentinel.
+//
+// The heap lives in its own kernel virtual region and starts out with only
+// HEAP_INITIAL bytes mapped. When nothing fits, fresh frames are mapped above
+// the sentinel and the new space joins the free pool. Once a free block grows
+// past HEAP_RELEASE_MIN its whole pages are unmapped again: at the top the
+// region shrinks, anywhere else the block keeps only the page holding its
+// header and carving from it maps the pages it needs back in.
+//
+// Every allocation is also charged to the call site that made it. Blocks
+// remember their site and requested size, so freeing can undo the charge and
+// the heap can be walked for a report of what is still outstanding.
 
-uint32_t kmalloc(uint32_t size) {
-    // Align to 4-byte boundary
-    size = (size + 3) & ~3;
-    
-    if (heap_current + size >= heap_end) {
-        return 0; // Out of memory
+#define HEAP_START       KERNEL_HEAP_START
+#define HEAP_INITIAL     0x100000 // Mapped on first use
+#define HEAP_GROW_MIN    0x10000  // Smallest extension, so growth stays rare
+#define HEAP_RELEASE_MIN 0x40000  // Free block worth giving pages back for
+#define HEAP_TRIM_KEEP   0x10000  // Left mapped when the top is trimmed
+
+#define BLOCK_USED       0x1
+#define BLOCK_SMALL      0x2
+#define BLOCK_PARKED     0x4 // Small block waiting on its class free list
+#define BLOCK_FLAGS      0x7
+#define BLOCK_SIZE(b)    ((b)->size & ~BLOCK_FLAGS)
+
+#define HEAP_ALIGN       8
+#define HEAP_MIN_BLOCK   32
+#define HEAP_MIN_SHIFT   5  // 32-byte blocks
+#define HEAP_SMALL_SHIFT 11 // 2048-byte blocks
+#define HEAP_SMALL_MAX   ((1u << HEAP_SMALL_SHIFT) - sizeof(heap_block_t))
+#define HEAP_NUM_CLASSES (HEAP_SMALL_SHIFT - HEAP_MIN_SHIFT + 1)
+
+#define HEAP_SITES       64 // Call sites tracked; slot 0 collects any overflow
+#define HEAP_HIST_SHIFT  4  // Smallest histogram bucket is 16 bytes
+#define HEAP_HIST_BUCKETS 16
+#define HEAP_FAIL_REPORTS 8 // Allocation failures logged before going quiet
+
+typedef struct heap_block {
+    uint32_t size;      // Block size including header, low bits are flags
+    uint32_t prev_size; // Size of the physically preceding block (0 if first)
+    uint32_t requested; // Bytes asked for, while in use
+    uint32_t site;      // Index into heap_sites, while in use
+} heap_block_t;
+
+typedef struct {
+    uint32_t caller;     // Return address of the allocation call
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+} heap_site_t;
+
+static heap_site_t heap_sites[HEAP_SITES];
+
+static struct {
+    uint32_t live_bytes;  // Requested bytes outstanding
+    uint32_t peak_bytes;
+    uint32_t block_bytes; // Heap consumed by those requests, headers included
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t pages;       // Frames mapped into the heap
+    uint32_t grows;       // Times the top of the heap moved up
+    uint32_t trims;       // ...and back down
+    uint32_t released;    // Frames given back from inside free blocks
+    uint32_t histogram[HEAP_HIST_BUCKETS]; // Requests by power-of-two size
+} heap_stats;
+
+#define CALLER() ((uint32_t)__builtin_return_address(0))
+
+// Free blocks keep their list links in the payload
+typedef struct free_block {
+    heap_block_t header;
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+static free_block_t *small_free[HEAP_NUM_CLASSES];
+static free_block_t *large_free = NULL;
+static heap_block_t *heap_sentinel = NULL;
+static uint32_t heap_top = HEAP_START; // End of the mapped part of the region
+static bool heap_ready = false;
+
+// Guards the block chain, free lists and accounting; taken with interrupts
+// off and held through growing or trimming the region
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+static inline heap_block_t *next_block(heap_block_t *b) {
+    return (heap_block_t*)((uint32_t)b + BLOCK_SIZE(b));
+}
+
+static inline heap_block_t *prev_block(heap_block_t *b) {
+    return b->prev_size ? (heap_block_t*)((uint32_t)b - b->prev_size) : NULL;
+}
+
+static inline bool in_heap(uint32_t addr) {
+    return addr >= HEAP_START + sizeof(heap_block_t) && addr < (uint32_t)heap_sentinel;
+}
+
+static bool heap_init(void) {
+    if (!map_kernel_range(HEAP_START, HEAP_START + HEAP_INITIAL)) return false;
+    heap_top = HEAP_START + HEAP_INITIAL;
+    heap_stats.pages = HEAP_INITIAL / PAGE_SIZE;
+
+    free_block_t *first = (free_block_t*)HEAP_START;
+    first->header.size = HEAP_INITIAL - sizeof(heap_block_t);
+    first->header.prev_size = 0;
+    first->next = NULL;
+    first->prev = NULL;
+    large_free = first;
+
+    // Zero-sized, always-used block that stops coalescing at the top
+    heap_sentinel = next_block(&first->header);
+    heap_sentinel->size = BLOCK_USED;
+    heap_sentinel->prev_size = BLOCK_SIZE(&first->header);
+
+    for (int i = 0; i < HEAP_NUM_CLASSES; i++) {
+        small_free[i] = NULL;
     }
-    uint32_t addr = heap_current;
-    heap_current += size;
-    return addr;
+    heap_ready = true;
+    return true;
+}
+
+static void large_list_insert(free_block_t *b) {
+    b->prev = NULL;
+    b->next = large_free;
+    if (large_free) large_free->prev = b;
+    large_free = b;
+}
+
+static void large_list_remove(free_block_t *b) {
+    if (b->prev) b->prev->next = b->next;
+    else large_free = b->next;
+    if (b->next) b->next->prev = b->prev;
+}
+
+// Resize a block in place and keep the following block's back-link in sync
+static inline void set_block_size(heap_block_t *b, uint32_t size, uint32_t flags) {
+    b->size = size | flags;
+    next_block(b)->prev_size = size;
+}
+
+// Trim a used block down to `size`, returning the tail to the free pool
+static void split_block(heap_block_t *b, uint32_t size) {
+    uint32_t total = BLOCK_SIZE(b);
+    if (total - size < HEAP_MIN_BLOCK) return;
+
+    set_block_size(b, size, b->size & BLOCK_FLAGS);
+    heap_block_t *rest = next_block(b);
+    rest->prev_size = size;
+    set_block_size(rest, total - size, 0);
+
+    // The tail may border another free block
+    heap_block_t *after = next_block(rest);
+    if (!(after->size & BLOCK_USED)) {
+        large_list_remove((free_block_t*)after);
+        set_block_size(rest, BLOCK_SIZE(rest) + BLOCK_SIZE(after), 0);
+    }
+    large_list_insert((free_block_t*)rest);
+}
+
+// Map any pages under [start, end) released while they were free
+static bool heap_back(uint32_t start, uint32_t end) {
+    for (uint32_t page = start & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        if (get_physical_address(page)) continue;
+        if (!map_kernel_range(page, page + PAGE_SIZE)) return false;
+        heap_stats.pages++;
+    }
+    return true;
+}
+
+// First-fit search of the large free list for a block of `size` bytes whose
+// payload can be placed on an `align` boundary
+static heap_block_t *large_alloc(uint32_t size, uint32_t align) {
+    for (free_block_t *f = large_free; f; f = f->next) {
+        uint32_t start = (uint32_t)f;
+        uint32_t avail = BLOCK_SIZE(&f->header);
+        uint32_t payload = start + sizeof(heap_block_t);
+        uint32_t lead = 0;
+
+        if (payload & (align - 1)) {
+            lead = ((payload + align - 1) & ~(align - 1)) - payload;
+            // The skipped prefix must be large enough to stand as a free block
+            while (lead < HEAP_MIN_BLOCK) lead += align;
+        }
+        if (avail < lead + size) continue;
+
+        // Map whatever was released under the block and the header of the
+        // remainder split off after it
+        uint32_t end = start + lead + size + sizeof(free_block_t);
+        if (end > start + avail) end = start + avail;
+        if (!heap_back(start, end)) return NULL;
+
+        large_list_remove(f);
+        heap_block_t *b = &f->header;
+
+        if (lead) {
+            // Give the leading fragment back as its own free block
+            set_block_size(b, lead, 0);
+            large_list_insert((free_block_t*)b);
+            heap_block_t *aligned = next_block(b);
+            aligned->prev_size = lead;
+            b = aligned;
+            set_block_size(b, avail - lead, BLOCK_USED);
+        } else {
+            b->size = avail | BLOCK_USED;
+        }
+
+        split_block(b, size);
+        return b;
+    }
+    return NULL;
+}
+
+// Returns the free block `b` ended up in after merging
+static heap_block_t *large_free_block(heap_block_t *b) {
+    uint32_t size = BLOCK_SIZE(b);
+
+    // Merge with the following block
+    heap_block_t *next = next_block(b);
+    if (!(next->size & BLOCK_USED)) {
+        large_list_remove((free_block_t*)next);
+        size += BLOCK_SIZE(next);
+    }
+
+    // Merge with the preceding block
+    heap_block_t *prev = prev_block(b);
+    if (prev && !(prev->size & BLOCK_USED)) {
+        large_list_remove((free_block_t*)prev);
+        size += BLOCK_SIZE(prev);
+        b = prev;
+    }
+
+    set_block_size(b, size, 0);
+    large_list_insert((free_block_t*)b);
+    return b;
+}
+
+// Map enough fresh pages above the sentinel for a `size`-byte block on an
+// `align` boundary. The old sentinel becomes a free block over the new
+// space, merging with any free block that already ended the heap.
+static bool heap_grow(uint32_t size, uint32_t align) {
+    uint32_t room = kernel_heap_end - heap_top;
+    if (size > room) return false;
+
+    uint32_t bytes = size + align + HEAP_MIN_BLOCK;
+    if (bytes < HEAP_GROW_MIN) bytes = HEAP_GROW_MIN;
+    bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (bytes > room) bytes = room;
+    if (!map_kernel_range(heap_top, heap_top + bytes)) return false;
+    heap_stats.pages += bytes / PAGE_SIZE;
+
+    heap_block_t *b = heap_sentinel;
+    heap_top += bytes;
+    heap_sentinel = (heap_block_t*)(heap_top - sizeof(heap_block_t));
+    heap_sentinel->size = BLOCK_USED;
+    set_block_size(b, bytes, 0);
+    large_free_block(b);
+    heap_stats.grows++;
+    return true;
+}
+
+// Give the whole pages of a large free block back to the frame allocator.
+// At the top, the heap shrinks to just above the block plus a little slack
+// so the next allocation doesn't grow it straight back.
+static void heap_release(heap_block_t *b) {
+    if (BLOCK_SIZE(b) < HEAP_RELEASE_MIN) return;
+
+    if (next_block(b) != heap_sentinel) {
+        uint32_t start = ((uint32_t)b + sizeof(free_block_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        uint32_t end = (uint32_t)next_block(b) & ~(PAGE_SIZE - 1);
+        if (end > start) {
+            uint32_t freed = unmap_kernel_range(start, end);
+            heap_stats.pages -= freed;
+            heap_stats.released += freed;
+        }
+        return;
+    }
+
+    uint32_t new_top = (uint32_t)b + HEAP_TRIM_KEEP + sizeof(heap_block_t);
+    new_top = (new_top + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (new_top < HEAP_START + HEAP_INITIAL) new_top = HEAP_START + HEAP_INITIAL;
+    if (new_top >= heap_top || !heap_back(new_top - PAGE_SIZE, new_top)) return;
+
+    heap_sentinel = (heap_block_t*)(new_top - sizeof(heap_block_t));
+    heap_sentinel->size = BLOCK_USED;
+    set_block_size(b, (uint32_t)heap_sentinel - (uint32_t)b, 0);
+    heap_stats.pages -= unmap_kernel_range(new_top, heap_top);
+    heap_top = new_top;
+    heap_stats.trims++;
+}
+
+// Carve from the large pool, growing the heap once if nothing fits
+static heap_block_t *large_alloc_grow(uint32_t size, uint32_t align) {
+    heap_block_t *b = large_alloc(size, align);
+    if (!b && heap_grow(size, align)) {
+        b = large_alloc(size, align);
+    }
+    return b;
+}
+
+static inline uint32_t size_class(uint32_t size) {
+    uint32_t cls = 0;
+    uint32_t block = 1u << HEAP_MIN_SHIFT;
+    while (block < size + sizeof(heap_block_t)) {
+        block <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+// Class of a carved small block. Carving may leave a few bytes of slack that
+// were too small to split off, so round down rather than up.
+static inline uint32_t block_class(heap_block_t *b) {
+    uint32_t cls = 0;
+    uint32_t size = BLOCK_SIZE(b) >> HEAP_MIN_SHIFT;
+    while (size > 1) {
+        size >>= 1;
+        cls++;
+    }
+    return cls;
+}
+
+// Slot for a call site: a short linear probe from its hash, or the shared
+// overflow slot once the table is full
+static uint32_t site_index(uint32_t caller) {
+    uint32_t slot = ((caller >> 2) * 2654435761u) >> 26;
+    for (uint32_t i = 0; i < HEAP_SITES - 1; i++) {
+        if (slot == 0) slot = 1;
+        heap_site_t *site = &heap_sites[slot];
+        if (site->caller == caller) return slot;
+        if (site->caller == 0) {
+            site->caller = caller;
+            return slot;
+        }
+        slot = (slot + 1) & (HEAP_SITES - 1);
+    }
+    return 0;
+}
+
+static inline uint32_t hist_bucket(uint32_t size) {
+    uint32_t bucket = 0;
+    size = (size - 1) >> HEAP_HIST_SHIFT;
+    while (size && bucket < HEAP_HIST_BUCKETS - 1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void account_alloc(heap_block_t *b, uint32_t size, uint32_t site_slot) {
+    heap_site_t *site = &heap_sites[site_slot];
+    b->site = site_slot;
+    b->requested = size;
+
+    site->allocs++;
+    site->live_bytes += size;
+    if (site->live_bytes > site->peak_bytes) site->peak_bytes = site->live_bytes;
+
+    heap_stats.allocs++;
+    heap_stats.live_bytes += size;
+    heap_stats.block_bytes += BLOCK_SIZE(b);
+    if (heap_stats.live_bytes > heap_stats.peak_bytes) heap_stats.peak_bytes = heap_stats.live_bytes;
+    heap_stats.histogram[hist_bucket(size)]++;
+}
+
+static void account_free(heap_block_t *b) {
+    heap_site_t *site = &heap_sites[b->site];
+    site->frees++;
+    site->live_bytes -= b->requested;
+
+    heap_stats.frees++;
+    heap_stats.live_bytes -= b->requested;
+    heap_stats.block_bytes -= BLOCK_SIZE(b);
+}
+
+static heap_block_t *heap_alloc_block(uint32_t size, uint32_t align) {
+    if (size <= HEAP_SMALL_MAX && align <= HEAP_ALIGN) {
+        uint32_t cls = size_class(size);
+        free_block_t *f = small_free[cls];
+        if (f) {
+            small_free[cls] = f->next;
+            f->header.size &= ~BLOCK_PARKED;
+            return &f->header;
+        }
+
+        // Class list is empty, carve a fresh block from the large pool
+        heap_block_t *b = large_alloc_grow(1u << (cls + HEAP_MIN_SHIFT), HEAP_ALIGN);
+        if (b) b->size |= BLOCK_SMALL;
+        return b;
+    }
+
+    uint32_t block_size = (size + sizeof(heap_block_t) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (block_size < HEAP_MIN_BLOCK) block_size = HEAP_MIN_BLOCK;
+    return large_alloc_grow(block_size, align < HEAP_ALIGN ? HEAP_ALIGN : align);
+}
+
+static void *heap_alloc(uint32_t size, uint32_t align, uint32_t caller) {
+    if (size == 0) size = 1;
+
+    uint32_t irq = spin_lock_irqsave(&heap_lock);
+    heap_block_t *b = heap_ready || heap_init() ? heap_alloc_block(size, align) : NULL;
+    if (b) {
+        account_alloc(b, size, site_index(caller));
+    } else {
+        heap_stats.failures++;
+    }
+    spin_unlock_irqrestore(&heap_lock, irq);
+
+    if (!b) {
+        if (heap_stats.failures <= HEAP_FAIL_REPORTS) {
+            printf("kmalloc: out of memory for %u bytes (caller %p)\n", size, (void*)caller);
+        }
+        return NULL;
+    }
+    return (void*)((uint32_t)b + sizeof(heap_block_t));
+}
+
+uint32_t kmalloc(uint32_t size) {
+    return (uint32_t)heap_alloc(size, HEAP_ALIGN, CALLER());
 }
 
 uint32_t kmalloc_a(uint32_t size) {
     // Align to page boundary (4KB)
-    heap_current = (heap_current + 0xFFF) & ~0xFFF;
-    return kmalloc(size);
+    return (uint32_t)heap_alloc(size, 0x1000, CALLER());
 }
 
+// Heap pages are mapped one frame at a time, so the physical address only
+// holds up to the end of the first page
 uint32_t kmalloc_p(uint32_t size, uint32_t *phys_addr) {
-    uint32_t addr = kmalloc(size);
+    uint32_t addr = (uint32_t)heap_alloc(size, HEAP_ALIGN, CALLER());
     if (phys_addr) {
-        *phys_addr = addr; // Simple for now; virtual = physical
+        *phys_addr = addr ? get_physical_address(addr) : 0;
     }
     return addr;
 }
 
 uint32_t kmalloc_ap(uint32_t size, uint32_t *phys_addr) {
-    uint32_t addr = kmalloc_a(size);
+    uint32_t addr = (uint32_t)heap_alloc(size, 0x1000, CALLER());
     if (phys_addr) {
-        *phys_addr = addr;
+        *phys_addr = addr ? get_physical_address(addr) : 0;
     }
     return addr;
 }
 
+static void heap_free(heap_block_t *b) {
+    if (!(b->size & BLOCK_USED) || (b->size & BLOCK_PARKED)) return; // Double free
+
+    account_free(b);
+    if (b->size & BLOCK_SMALL) {
+        // Small blocks stay "used" as far as the large pool is concerned
+        uint32_t cls = block_class(b);
+        free_block_t *f = (free_block_t*)b;
+        b->size |= BLOCK_PARKED;
+        f->next = small_free[cls];
+        small_free[cls] = f;
+        return;
+    }
+
+    heap_release(large_free_block(b));
+}
+
 void kfree(void *ptr) {
-    // Simple implementation - no actual freeing
-    // TODO: Implement proper free list
-    (void)ptr; // Suppress unused parameter warning
+    if (!ptr || !heap_ready || !in_heap((uint32_t)ptr)) return;
+
+    uint32_t irq = spin_lock_irqsave(&heap_lock);
+    heap_free((heap_block_t*)((uint32_t)ptr - sizeof(heap_block_t)));
+    spin_unlock_irqrestore(&heap_lock, irq);
+}
+
+void *krealloc(void *ptr, uint32_t size) {
+    if (!ptr) return heap_alloc(size, HEAP_ALIGN, CALLER());
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+    if (!in_heap((uint32_t)ptr)) return NULL;
+
+    heap_block_t *b = (heap_block_t*)((uint32_t)ptr - sizeof(heap_block_t));
+    uint32_t capacity = BLOCK_SIZE(b) - sizeof(heap_block_t);
+    if (size <= capacity) return ptr;
+
+    if (!(b->size & BLOCK_SMALL)) {
+        // Grow in place by absorbing a free neighbour
+        uint32_t needed = (size + sizeof(heap_block_t) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+        uint32_t irq = spin_lock_irqsave(&heap_lock);
+        heap_block_t *next = next_block(b);
+        bool grown = !(next->size & BLOCK_USED) && BLOCK_SIZE(b) + BLOCK_SIZE(next) >= needed &&
+                     heap_back((uint32_t)next, (uint32_t)b + needed + sizeof(free_block_t));
+        if (grown) {
+            uint32_t site = b->site;
+            account_free(b);
+            large_list_remove((free_block_t*)next);
+            set_block_size(b, BLOCK_SIZE(b) + BLOCK_SIZE(next), BLOCK_USED);
+            split_block(b, needed);
+            account_alloc(b, size, site);
+        }
+        spin_unlock_irqrestore(&heap_lock, irq);
+        if (grown) return ptr;
+    }
+
+    void *new_ptr = heap_alloc(size, HEAP_ALIGN, CALLER());
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, capacity);
+    kfree(ptr);
+    return new_ptr;
+}
+
+// part/whole as a percentage without overflowing 32 bits
+static uint32_t percent(uint32_t part, uint32_t whole) {
+    if (whole == 0) return 0;
+    if (whole > 0xFFFFFFFF / 100) return part / (whole / 100);
+    return part * 100 / whole;
+}
+
+void heap_report(void) {
+    if (!heap_ready && !heap_init()) return;
+
+    // Walk the block chain for the free-space picture
+    uint32_t free_bytes = 0, free_blocks = 0, largest = 0, parked = 0;
+    for (heap_block_t *b = (heap_block_t*)HEAP_START; b != heap_sentinel; b = next_block(b)) {
+        if (!(b->size & BLOCK_USED)) {
+            free_bytes += BLOCK_SIZE(b);
+            free_blocks++;
+            if (BLOCK_SIZE(b) > largest) largest = BLOCK_SIZE(b);
+        } else if (b->size & BLOCK_PARKED) {
+            parked += BLOCK_SIZE(b);
+        }
+    }
+
+    printf("Heap: %u KB mapped, spanning %u KB of %u KB at 0x%x\n",
+           heap_stats.pages * (PAGE_SIZE / 1024), (heap_top - HEAP_START) >> 10,
+           (kernel_heap_end - HEAP_START) >> 10, HEAP_START);
+    printf("  grown %u times, trimmed %u, %u pages released from free blocks\n",
+           heap_stats.grows, heap_stats.trims, heap_stats.released);
+    printf("  live %u bytes, peak %u, in %u bytes of blocks\n",
+           heap_stats.live_bytes, heap_stats.peak_bytes, heap_stats.block_bytes);
+    printf("  allocs %u, frees %u, failures %u\n",
+           heap_stats.allocs, heap_stats.frees, heap_stats.failures);
+    printf("  free %u bytes in %u blocks, largest %u, parked in size classes %u\n",
+           free_bytes, free_blocks, largest, parked);
+    printf("  fragmentation: external %u%%, internal %u%%\n",
+           free_bytes ? 100 - percent(largest, free_bytes) : 0,
+           percent(heap_stats.block_bytes - heap_stats.live_bytes, heap_stats.block_bytes));
+
+    printf("Request sizes:\n");
+    for (uint32_t i = 0; i < HEAP_HIST_BUCKETS; i++) {
+        if (heap_stats.histogram[i] == 0) continue;
+        printf("  %s%u\t%u\n", i == HEAP_HIST_BUCKETS - 1 ? ">" : "<=",
+               1u << (i + HEAP_HIST_SHIFT - (i == HEAP_HIST_BUCKETS - 1)), heap_stats.histogram[i]);
+    }
+
+    printf("caller\t\tallocs\tfrees\tlive\tpeak\n");
+    for (uint32_t i = 0; i < HEAP_SITES; i++) {
+        heap_site_t *site = &heap_sites[i];
+        if (site->allocs == 0) continue;
+        if (i == 0) {
+            printf("(other)\t\t");
+        } else {
+            printf("0x%x\t", site->caller);
+        }
+        printf("%u\t%u\t%u\t%u\n", site->allocs, site->frees, site->live_bytes, site->peak_bytes);
+    }
+}
+
+// Outstanding allocations, oldest addresses first, tagged with their caller
+void heap_leak_report(uint32_t limit) {
+    if (!heap_ready && !heap_init()) return;
+
+    uint32_t shown = 0, total = 0;
+    printf("address\t\tbytes\tcaller\n");
+    for (heap_block_t *b = (heap_block_t*)HEAP_START; b != heap_sentinel; b = next_block(b)) {
+        if (!(b->size & BLOCK_USED) || (b->size & BLOCK_PARKED)) continue;
+        total++;
+        if (shown < limit) {
+            printf("0x%x\t%u\t0x%x\n", (uint32_t)b + sizeof(heap_block_t),
+                   b->requested, heap_sites[b->site].caller);
+            shown++;
+        }
+    }
+    printf("%u outstanding allocations", total);
+    if (total > shown) printf(" (%u not shown)", total - shown);
+    printf("\n");
 }
 
 void *malloc(size_t size) {
-    return (void*)kmalloc(size);
+    return heap_alloc(size, HEAP_ALIGN, CALLER());
 }
 
 void free(void *ptr) {
     kfree(ptr);
 }
 
+// The memory routines below move 32-bit words with the string instructions.
+// Interrupt entry clears DF, so they can rely on it being clear on entry.
+
+#define MEM_WORD_MIN 16 // Below this, aligning the head costs more than it saves
+
+typedef uint32_t __attribute__((may_alias)) mem_word_t;
+
 void *memset(void *dest, int c, size_t n) {
     uint8_t *d = (uint8_t*)dest;
-    for (size_t i = 0; i < n; i++) {
-        d[i] = (uint8_t)c;
+    uint32_t value = (uint8_t)c * 0x01010101;
+    
+    if (n >= MEM_WORD_MIN) {
+        size_t head = -(uint32_t)d & 3;
+        n -= head;
+        asm volatile("rep stosb" : "+D"(d), "+c"(head) : "a"(value) : "memory");
+        size_t words = n >> 2;
+        asm volatile("rep stosl" : "+D"(d), "+c"(words) : "a"(value) : "memory");
+        n &= 3;
     }
+    asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(value) : "memory");
     return dest;
 }
 
 void *memcpy(void *dest, const void *src, size_t n) {
     uint8_t *d = (uint8_t*)dest;
     const uint8_t *s = (const uint8_t*)src;
-    for (size_t i = 0; i < n; i++) {
-        d[i] = s[i];
+    
+    // Align the destination; misaligned loads are cheaper than stores
+    if (n >= MEM_WORD_MIN) {
+        size_t head = -(uint32_t)d & 3;
+        n -= head;
+        asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(head) : : "memory");
+        size_t words = n >> 2;
+        asm volatile("rep movsl" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+        n &= 3;
     }
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
     return dest;
 }
 
@@ -75,15 +654,27 @@ void *memmove(void *dest, const void *src, size_t n) {
     uint8_t *d = (uint8_t*)dest;
     const uint8_t *s = (const uint8_t*)src;
     
-    if (d < s) {
-        for (size_t i = 0; i < n; i++) {
-            d[i] = s[i];
-        }
-    } else {
-        for (size_t i = n; i > 0; i--) {
-            d[i-1] = s[i-1];
-        }
+    // A forward copy is safe unless the destination overlaps the source's tail
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
     }
+    
+    // Copy backwards from the last byte: the odd tail bytes first, then
+    // whole words, then restore DF before anything else can see it
+    size_t tail = n & 3;
+    size_t words = n >> 2;
+    d += n - 1;
+    s += n - 1;
+    asm volatile("std\n\t"
+                 "rep movsb\n\t"
+                 "sub $3, %%esi\n\t"
+                 "sub $3, %%edi\n\t"
+                 "mov %3, %%ecx\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+D"(d), "+S"(s), "+c"(tail)
+                 : "r"(words)
+                 : "memory", "cc");
     return dest;
 }
 
@@ -91,6 +682,12 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t*)s1;
     const uint8_t *p2 = (const uint8_t*)s2;
     
+    // Skip equal words, then let the byte loop find the first difference
+    while (n >= 4 && *(const mem_word_t*)p1 == *(const mem_word_t*)p2) {
+        p1 += 4;
+        p2 += 4;
+        n -= 4;
+    }
     for (size_t i = 0; i < n; i++) {
         if (p1[i] < p2[i]) return -1;
         if (p1[i] > p2[i]) return 1;
@@ -100,10 +697,25 @@ int memcmp(const void *s1, const void *s2, size_t n) {
 
 void *memchr(const void *s, int c, size_t n) {
     const uint8_t *p = (const uint8_t*)s;
-    for (size_t i = 0; i < n; i++) {
-        if (p[i] == (uint8_t)c) {
-            return (void*)(p + i);
-        }
+    uint8_t target = (uint8_t)c;
+    
+    while (n > 0 && ((uint32_t)p & 3)) {
+        if (*p == target) return (void*)p;
+        p++;
+        n--;
+    }
+    
+    // An aligned word never crosses a page, so it's safe to read all of it.
+    // XOR zeroes the matching bytes; the classic test spots any zero byte.
+    uint32_t pattern = target * 0x01010101;
+    while (n >= 4) {
+        uint32_t x = *(const mem_word_t*)p ^ pattern;
+        if ((x - 0x01010101) & ~x & 0x80808080) break;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--) {
+        if (*p == target) return (void*)p;
     }
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,61 @@
+#include "wait.h"
+#include "sched.h"
+#include "kernel.h"
+
+spinlock_t wait_lock = SPINLOCK_INIT;
+
+void wait_queue_init(wait_queue_t *wq) {
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+static void wait_remove(wait_queue_t *wq, wait_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wq->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        wq->tail = entry->prev;
+    }
+    entry->proc = NULL;
+}
+
+void wait_sleep(wait_queue_t *wq) {
+    process_t *proc = current_process;
+    if (!proc || proc == idle_process) {
+        spin_unlock(&wait_lock);
+        kernel_idle();
+        spin_lock(&wait_lock);
+        return;
+    }
+
+    wait_entry_t entry = { proc, NULL, wq->tail };
+    if (wq->tail) {
+        wq->tail->next = &entry;
+    } else {
+        wq->head = &entry;
+    }
+    wq->tail = &entry;
+
+    sched_block(&wait_lock);
+    spin_lock(&wait_lock);
+
+    // Still queued if something other than wake_up woke the task
+    if (entry.proc) {
+        wait_remove(wq, &entry);
+    }
+}
+
+void wake_up(wait_queue_t *wq) {
+    uint32_t irq = spin_lock_irqsave(&wait_lock);
+    while (wq->head) {
+        wait_entry_t *entry = wq->head;
+        process_t *proc = entry->proc;
+        wait_remove(wq, entry);
+        sched_wakeup(proc);
+    }
+    spin_unlock_irqrestore(&wait_lock, irq);
+}
@@ -0,0 +1,95 @@
+#include "workqueue.h"
+#include "process.h"
+#include "sched.h"
+#include "wait.h"
+#include "clock.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// One FIFO shared by every worker; whichever is free first takes the
+// oldest item, so a slow item only holds up the worker running it
+
+workqueue_stats_t workqueue_stats;
+
+static spinlock_t work_lock = SPINLOCK_INIT;
+static work_t *work_head = NULL;
+static work_t *work_tail = NULL;
+static wait_queue_t work_wait = WAIT_QUEUE_INIT;
+
+void work_init(work_t *work, void (*func)(work_t *work), void *data) {
+    work->func = func;
+    work->data = data;
+    work->next = NULL;
+    work->pending = false;
+    work->queued_tsc = 0;
+}
+
+bool queue_work(work_t *work) {
+    uint32_t irq = spin_lock_irqsave(&work_lock);
+    if (work->pending) {
+        workqueue_stats.requeued++;
+        spin_unlock_irqrestore(&work_lock, irq);
+        return false;
+    }
+    work->pending = true;
+    work->next = NULL;
+    work->queued_tsc = rdtsc();
+    if (work_tail) work_tail->next = work;
+    else work_head = work;
+    work_tail = work;
+    workqueue_stats.queued++;
+    spin_unlock_irqrestore(&work_lock, irq);
+
+    wake_up(&work_wait);
+    return true;
+}
+
+static work_t *work_dequeue(void) {
+    uint32_t irq = spin_lock_irqsave(&work_lock);
+    work_t *work = work_head;
+    if (work) {
+        work_head = work->next;
+        if (!work_head) work_tail = NULL;
+        work->next = NULL;
+        work->pending = false;
+
+        uint64_t waited = rdtsc() - work->queued_tsc;
+        if (waited > workqueue_stats.wait_max) workqueue_stats.wait_max = waited;
+        workqueue_stats.run++;
+    }
+    spin_unlock_irqrestore(&work_lock, irq);
+    return work;
+}
+
+// Every worker is woken for each item; the ones that find the queue
+// already empty go back to sleep
+static void worker_main(void) {
+    for (;;) {
+        wait_event(&work_wait, work_head != NULL);
+        work_t *work = work_dequeue();
+        if (work) {
+            work->func(work);
+        }
+    }
+}
+
+void workqueue_init(void) {
+    uint32_t workers = cpu_count < WORKQUEUE_MAX_WORKERS ? cpu_count : WORKQUEUE_MAX_WORKERS;
+    for (uint32_t i = 0; i < workers; i++) {
+        process_t *worker = create_process("kworker", worker_main, true);
+        if (!worker) break;
+        sched_set_priority(worker, WORKER_PRIORITY);
+        workqueue_stats.workers++;
+    }
+    printf("Workqueue: %u worker threads\n", workqueue_stats.workers);
+}
+
+void workqueue_report(void) {
+    workqueue_stats_t s = workqueue_stats;
+    uint32_t wait_us = (uint32_t)div_u64(cycles_to_ns(s.wait_max), NSEC_PER_USEC, NULL);
+
+    printf("Workqueue: %u workers\n", s.workers);
+    printf("queued\trun\trequeued\tmax wait\n");
+    printf("%u\t%u\t%u\t\t%u us\n", s.queued, s.run, s.requeued, wait_us);
+}
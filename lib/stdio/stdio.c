@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stddef.h>
 #include "kernel.h"
+#include "memory/slab.h"
 
 // Define EOF since we don't have it in freestanding mode
 #ifndef EOF
@@ -20,6 +21,9 @@ FILE *stdin = &stdin_file;
 FILE *stdout = &stdout_file;
 FILE *stderr = &stderr_file;
 
+// FILE handles come from their own cache, created on first fopen
+static kmem_cache_t *file_cache = NULL;
+
 // Define the buffer size for the streams
 #define BUFFER_SIZE 1024
 
@@ -49,7 +53,12 @@ FILE *fopen(const char *filename, const char *mode) {
     (void)filename; // Suppress unused parameter warning
     (void)mode;     // Suppress unused parameter warning
     
-    FILE *fp = malloc(sizeof(FILE));
+    if (!file_cache) {
+        file_cache = kmem_cache_create("FILE", sizeof(FILE), 4, 0, NULL);
+        if (!file_cache) return NULL;
+    }
+
+    FILE *fp = kmem_cache_alloc(file_cache);
     if (fp) {
         fp->fd = 0;
         fp->buffer = NULL;
@@ -62,8 +71,8 @@ FILE *fopen(const char *filename, const char *mode) {
 // Close a file
 int fclose(FILE *fp) {
     // For now, just free the FILE structure
-    if (fp) {
-        free(fp);
+    if (fp && fp != stdin && fp != stdout && fp != stderr) {
+        kmem_cache_free(file_cache, fp);
     }
     return 0;
 }